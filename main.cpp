@@ -1,8 +1,140 @@
-#include <iostream>
 #include <string>
 #include <memory>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <memory_resource>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <mutex>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <charconv>
+#include <type_traits>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cstdio>
+#include <algorithm>
+#include <unordered_set>
+#include <variant>
+#include <optional>
+#include <cstddef>
+#include <map>
+#include <array>
+#include <new>
+#include <cstdlib>
+#include <stdexcept>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIZZA_HAVE_X86_SIMD 1
+#endif
 using namespace std;
 
+// Writes every part, retrying short writes and EINTR; false on any other error
+bool writeFully(int fd, iovec* parts, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, parts, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count > 0 && static_cast<size_t>(written) >= parts->iov_len) {
+            written -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = static_cast<char*>(parts->iov_base) + written;
+            parts->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/* Every example prints through one buffered sink instead of cout/endl.
+ * Text is appended to a large preallocated buffer and only handed to the
+ * file descriptor at explicit flush() points or when the buffer fills;
+ * numbers are formatted with to_chars, so no locale or stream state is
+ * involved. A write bigger than the free space goes out together with the
+ * buffered bytes in one writev. The sink is not thread-safe: print from
+ * one thread. */
+class OutputSink
+{
+public:
+    explicit OutputSink(int fd = STDOUT_FILENO, size_t capacity = 64 * 1024)
+        : m_fd(fd), m_buffer(make_unique<char[]>(capacity)), m_capacity(capacity) {}
+    ~OutputSink()
+    {
+        flush();
+    }
+    OutputSink& operator<<(string_view text)
+    {
+        if (text.size() <= m_capacity - m_size) {
+            memcpy(m_buffer.get() + m_size, text.data(), text.size());
+            m_size += text.size();
+            return *this;
+        }
+        iovec parts[2] = { { m_buffer.get(), m_size },
+                           { const_cast<char*>(text.data()), text.size() } };
+        writeFully(m_fd, parts, 2); // on error there is nowhere to report it; drop the text
+        m_size = 0;
+        return *this;
+    }
+    OutputSink& operator<<(char c)
+    {
+        if (m_size == m_capacity)
+            flush();
+        m_buffer[m_size++] = c;
+        return *this;
+    }
+    template <typename T, typename = enable_if_t<is_integral_v<T> && !is_same_v<T, char>>>
+    OutputSink& operator<<(T value)
+    {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        return *this << string_view(digits, result.ptr - digits);
+    }
+    // Doubles are printed with three decimals
+    OutputSink& operator<<(double value)
+    {
+        char digits[64];
+        auto result = to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, 3);
+        return *this << string_view(digits, result.ptr - digits);
+    }
+    void flush()
+    {
+        iovec part = { m_buffer.get(), m_size };
+        writeFully(m_fd, &part, 1);
+        m_size = 0;
+    }
+private:
+    int m_fd;
+    unique_ptr<char[]> m_buffer;
+    size_t m_capacity;
+    size_t m_size = 0;
+};
+
+OutputSink& console()
+{
+    static OutputSink sink;
+    return sink;
+}
+
 
 //1. Builder design Pattern
 /*
@@ -10,125 +142,3645 @@ using namespace std;
  * representation so that the same construction
  * process can create different objects representations.
 
-Problem
-    We want to construct a complex object, however we do not want to have a
-    complex constructor member or one that would need many arguments.
+Problem
+    We want to construct a complex object, however we do not want to have a
+    complex constructor member or one that would need many arguments.
+
+Solution
+    Define an intermediate object whose member functions define the desired object part by part
+    before the object is available to the client.
+    Builder Pattern lets us defer the construction of the object until all
+    the options for creation have been specified.
+ */
+/* Ingredients are interned: a Pizza stores small integer ids and the
+ * strings are only looked up at the edges (open(), I/O). The values every
+ * builder uses are pre-interned with fixed ids so building needs no lookup. */
+using IngredientId = uint16_t;
+
+namespace Ingredient
+{
+    constexpr IngredientId None            = 0;
+    constexpr IngredientId Cross           = 1;
+    constexpr IngredientId PanBaked        = 2;
+    constexpr IngredientId Mild            = 3;
+    constexpr IngredientId Hot             = 4;
+}
+
+class IngredientTable
+{
+public:
+    static IngredientTable& instance()
+    {
+        static IngredientTable table;
+        return table;
+    }
+    // Ids run from 0 to capacity - 1; the largest IngredientId stays free for sentinels
+    static constexpr size_t capacity = numeric_limits<IngredientId>::max();
+
+    // Throws length_error once every id is taken
+    IngredientId intern(string_view name)
+    {
+        IngredientId id;
+        if (!tryIntern(name, id))
+            throw length_error("too many distinct ingredients");
+        return id;
+    }
+    // As intern, but returns false instead of throwing when the table is full
+    bool tryIntern(string_view name, IngredientId& id)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_ids.find(name);
+        if (it != m_ids.end()) {
+            id = it->second;
+            return true;
+        }
+        if (m_names.size() == capacity)
+            return false;
+        id = static_cast<IngredientId>(m_names.size());
+        m_names.emplace_back(name);
+        m_ids.emplace(m_names.back(), id);
+        return true;
+    }
+    const string& name(IngredientId id) const
+    {
+        lock_guard<mutex> lock(m_mutex);
+        return m_names.at(id); // deque elements never move, so the reference stays valid
+    }
+    size_t size() const
+    {
+        lock_guard<mutex> lock(m_mutex);
+        return m_names.size();
+    }
+private:
+    IngredientTable()
+    {
+        for (const char* name : { "", "cross", "pan baked", "mild", "hot" })
+            intern(name);
+    }
+    mutable mutex m_mutex;
+    deque<string> m_names;
+    unordered_map<string_view, IngredientId> m_ids;
+};
+
+/* Toppings are a set, not a string: each topping is one bit of a 16-bit
+ * ToppingSet, so contains / intersect / count are single instructions and
+ * builders never concatenate strings. "+"-joined text such as
+ * "ham+pineapple" is only parsed or produced at the edges. The well-known
+ * toppings have fixed bits; ToppingTable hands out the remaining bits to
+ * names first seen at runtime (menus, files). */
+enum class Topping : uint8_t
+{
+    Ham, Pineapple, Pepperoni, Salami, Mushroom, Olive, Onion
+};
+
+class ToppingTable
+{
+public:
+    static constexpr size_t capacity = 16;
+    // Interned by every process at startup, in Topping order
+    static constexpr string_view fixedNames[] = {
+        "ham", "pineapple", "pepperoni", "salami", "mushroom", "olive", "onion"
+    };
+
+    static ToppingTable& instance()
+    {
+        static ToppingTable table;
+        return table;
+    }
+    // Throws length_error once all 16 bits are taken
+    Topping intern(string_view name)
+    {
+        Topping topping;
+        if (!tryIntern(name, topping))
+            throw length_error("too many distinct toppings");
+        return topping;
+    }
+    // As intern, but returns false instead of throwing when the table is full
+    bool tryIntern(string_view name, Topping& topping)
+    {
+        return tryInternAll(&name, 1, &topping);
+    }
+    /* All or nothing: either every name gets a bit, written to the matching
+     * slot of toppings, or the names new to the table do not all fit and
+     * the table is left unchanged. */
+    bool tryInternAll(const string_view* names, size_t count, Topping* toppings)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        size_t added = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (findLocked(names[i]) < m_size || find(names, names + i, names[i]) != names + i)
+                continue;
+            if (++added > capacity - m_size)
+                return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t bit = findLocked(names[i]);
+            if (bit == m_size)
+                m_names[m_size++] = string(names[i]);
+            toppings[i] = static_cast<Topping>(bit);
+        }
+        return true;
+    }
+    const string& name(Topping topping) const
+    {
+        lock_guard<mutex> lock(m_mutex);
+        return m_names[static_cast<size_t>(topping)];
+    }
+    size_t size() const
+    {
+        lock_guard<mutex> lock(m_mutex);
+        return m_size;
+    }
+private:
+    ToppingTable()
+    {
+        for (string_view name : fixedNames)
+            intern(name);
+    }
+    size_t findLocked(string_view name) const
+    {
+        size_t bit = 0;
+        while (bit < m_size && m_names[bit] != name)
+            bit++;
+        return bit;
+    }
+
+    mutable mutex m_mutex;
+    string m_names[capacity];
+    size_t m_size = 0;
+};
+
+class ToppingSet
+{
+public:
+    constexpr ToppingSet() = default;
+    constexpr ToppingSet(initializer_list<Topping> toppings)
+    {
+        for (Topping topping : toppings)
+            add(topping);
+    }
+    static constexpr ToppingSet fromBits(uint16_t bits)
+    {
+        ToppingSet set;
+        set.m_bits = bits;
+        return set;
+    }
+    /* Parses "+"-joined names such as "pepperoni+salami". Throws
+     * length_error when a new name no longer fits in the ToppingTable. */
+    static ToppingSet parse(string_view text)
+    {
+        ToppingSet set;
+        if (!tryParse(text, set))
+            throw length_error("too many distinct toppings");
+        return set;
+    }
+    // As parse, but returns false instead of throwing
+    static bool tryParse(string_view text, ToppingSet& set)
+    {
+        vector<string_view> names;
+        while (!text.empty()) {
+            size_t plus = text.find('+');
+            if (plus != 0)
+                names.push_back(text.substr(0, plus));
+            text = plus == string_view::npos ? string_view() : text.substr(plus + 1);
+        }
+        vector<Topping> toppings(names.size());
+        if (!ToppingTable::instance().tryInternAll(names.data(), names.size(), toppings.data()))
+            return false;
+        set = ToppingSet();
+        for (Topping topping : toppings)
+            set.add(topping);
+        return true;
+    }
+    constexpr ToppingSet& add(Topping topping)
+    {
+        m_bits |= uint16_t(1u << static_cast<unsigned>(topping));
+        return *this;
+    }
+    constexpr bool contains(Topping topping) const
+    {
+        return m_bits >> static_cast<unsigned>(topping) & 1;
+    }
+    constexpr bool containsAll(ToppingSet other) const
+    {
+        return (m_bits & other.m_bits) == other.m_bits;
+    }
+    constexpr bool empty() const
+    {
+        return m_bits == 0;
+    }
+    int count() const
+    {
+        return __builtin_popcount(m_bits);
+    }
+    constexpr uint16_t bits() const
+    {
+        return m_bits;
+    }
+    string toString() const
+    {
+        string text;
+        const ToppingTable& table = ToppingTable::instance();
+        for (unsigned bit = 0; bit < ToppingTable::capacity; bit++) {
+            if (!(m_bits >> bit & 1))
+                continue;
+            if (!text.empty())
+                text += '+';
+            text += table.name(static_cast<Topping>(bit));
+        }
+        return text;
+    }
+    friend constexpr ToppingSet operator&(ToppingSet a, ToppingSet b)
+    {
+        return fromBits(a.m_bits & b.m_bits);
+    }
+    friend constexpr ToppingSet operator|(ToppingSet a, ToppingSet b)
+    {
+        return fromBits(a.m_bits | b.m_bits);
+    }
+    friend constexpr bool operator==(ToppingSet a, ToppingSet b)
+    {
+        return a.m_bits == b.m_bits;
+    }
+private:
+    uint16_t m_bits = 0;
+};
+
+// "Product"
+class Pizza
+{
+public:
+    constexpr void setDough(IngredientId dough)
+    {
+        m_dough = dough;
+    }
+    constexpr void setSauce(IngredientId sauce)
+    {
+        m_sauce = sauce;
+    }
+    constexpr void setToppings(ToppingSet toppings)
+    {
+        m_toppings = toppings;
+    }
+    void setDough(string_view dough)
+    {
+        m_dough = IngredientTable::instance().intern(dough);
+    }
+    void setSauce(string_view sauce)
+    {
+        m_sauce = IngredientTable::instance().intern(sauce);
+    }
+    void setTopping(string_view toppings)
+    {
+        m_toppings = ToppingSet::parse(toppings);
+    }
+    constexpr IngredientId dough() const
+    {
+        return m_dough;
+    }
+    constexpr IngredientId sauce() const
+    {
+        return m_sauce;
+    }
+    constexpr ToppingSet toppings() const
+    {
+        return m_toppings;
+    }
+    void open() const
+    {
+        const IngredientTable& table = IngredientTable::instance();
+        console() << "Pizza with " << table.name(m_dough) << " dough, " << table.name(m_sauce)
+                  << " sauce and " << m_toppings.toString() << " topping. Mmm." << '\n';
+    }
+    friend constexpr bool operator==(const Pizza& a, const Pizza& b)
+    {
+        return a.m_dough == b.m_dough && a.m_sauce == b.m_sauce && a.m_toppings == b.m_toppings;
+    }
+    size_t hash() const
+    {
+        // Combined in 64 bits, then folded, so a 32-bit size_t keeps the dough too
+        uint64_t hash = (uint64_t(m_dough) << 32) ^ (uint64_t(m_sauce) << 16) ^ m_toppings.bits();
+        return size_t(hash ^ (hash >> 32));
+    }
+private:
+    IngredientId m_dough = Ingredient::None;
+    IngredientId m_sauce = Ingredient::None;
+    ToppingSet m_toppings;
+};
+
+/* Fixed-capacity string stored inline: no heap, trivially copyable.
+ * Assigning more than Capacity characters throws length_error. */
+template <size_t Capacity>
+class InlineString
+{
+    static_assert(Capacity < 256, "the length is kept in one byte");
+public:
+    InlineString() = default;
+    InlineString(string_view text)
+    {
+        assign(text);
+    }
+    void assign(string_view text)
+    {
+        if (text.size() > Capacity)
+            throw length_error("InlineString capacity exceeded");
+        memcpy(m_data, text.data(), text.size());
+        m_size = static_cast<uint8_t>(text.size());
+    }
+    string_view view() const
+    {
+        return string_view(m_data, m_size);
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+    friend bool operator==(const InlineString& a, const InlineString& b)
+    {
+        return a.view() == b.view();
+    }
+private:
+    char m_data[Capacity] = {};
+    uint8_t m_size = 0;
+};
+
+/* Pizza variant that keeps its ingredient names inline, for consumers
+ * that need the text without going through IngredientTable. Three 20-char
+ * fields fill exactly one cache line and the object is trivially
+ * copyable, so copies are a single 64-byte move. */
+class alignas(64) InlinePizza
+{
+public:
+    InlinePizza() = default;
+    // Throws length_error when a name, e.g. a long topping list, is over 20 characters
+    explicit InlinePizza(const Pizza& pizza);
+    // As the constructor, but nullopt instead of throwing
+    static optional<InlinePizza> from(const Pizza& pizza);
+
+    void setDough(string_view dough)
+    {
+        m_dough.assign(dough);
+    }
+    void setSauce(string_view sauce)
+    {
+        m_sauce.assign(sauce);
+    }
+    void setTopping(string_view topping)
+    {
+        m_topping.assign(topping);
+    }
+    string_view dough() const
+    {
+        return m_dough.view();
+    }
+    string_view sauce() const
+    {
+        return m_sauce.view();
+    }
+    string_view topping() const
+    {
+        return m_topping.view();
+    }
+    Pizza toPizza() const
+    {
+        Pizza pizza;
+        pizza.setDough(dough());
+        pizza.setSauce(sauce());
+        pizza.setTopping(topping());
+        return pizza;
+    }
+    void open() const
+    {
+        console() << "Pizza with " << dough() << " dough, " << sauce() << " sauce and "
+                  << topping() << " topping. Mmm." << '\n';
+    }
+private:
+    InlineString<20> m_dough;
+    InlineString<20> m_sauce;
+    InlineString<20> m_topping;
+};
+static_assert(sizeof(InlinePizza) == 64 && is_trivially_copyable_v<InlinePizza>,
+              "InlinePizza should be one trivially copyable cache line");
+
+inline InlinePizza::InlinePizza(const Pizza& pizza)
+{
+    const IngredientTable& table = IngredientTable::instance();
+    setDough(table.name(pizza.dough()));
+    setSauce(table.name(pizza.sauce()));
+    setTopping(pizza.toppings().toString());
+}
+
+inline optional<InlinePizza> InlinePizza::from(const Pizza& pizza)
+{
+    const IngredientTable& table = IngredientTable::instance();
+    const string& dough = table.name(pizza.dough());
+    const string& sauce = table.name(pizza.sauce());
+    string topping = pizza.toppings().toString();
+    if (max({ dough.size(), sauce.size(), topping.size() }) > 20)
+        return nullopt;
+    InlinePizza inlined;
+    inlined.setDough(dough);
+    inlined.setSauce(sauce);
+    inlined.setTopping(topping);
+    return inlined;
+}
+
+// Frees a Pizza either from the heap or from the memory resource it was carved from
+struct PizzaDeleter
+{
+    pmr::memory_resource* resource = nullptr;
+
+    void operator()(Pizza* pizza) const
+    {
+        if (!resource) {
+            delete pizza;
+            return;
+        }
+        pizza->~Pizza();
+        resource->deallocate(pizza, sizeof(Pizza), alignof(Pizza));
+    }
+};
+using PizzaPtr = unique_ptr<Pizza, PizzaDeleter>;
+
+/* Free list of finished pizzas. Callers hand pizzas back with release()
+ * and acquire() reuses them, so once the pool has grown to the working
+ * set, order processing no longer allocates. Not thread-safe: use one pool
+ * per thread, or guard it externally. */
+class PizzaPool
+{
+public:
+    explicit PizzaPool(size_t preallocate = 0)
+    {
+        m_free.reserve(preallocate);
+        for (size_t i = 0; i < preallocate; i++)
+            m_free.push_back(PizzaPtr(new Pizza));
+    }
+    PizzaPtr acquire()
+    {
+        if (m_free.empty())
+            return PizzaPtr(new Pizza);
+        PizzaPtr pizza = move(m_free.back());
+        m_free.pop_back();
+        *pizza = Pizza();
+        return pizza;
+    }
+    void release(PizzaPtr pizza)
+    {
+        if (pizza)
+            m_free.push_back(move(pizza));
+    }
+    size_t available() const
+    {
+        return m_free.size();
+    }
+private:
+    vector<PizzaPtr> m_free;
+};
+
+// Build steps as seen by schedulers; a set of steps is a mask of stepBit()
+enum class BuildStep : uint8_t { Dough, Sauce, Topping };
+constexpr size_t buildStepCount = 3;
+
+constexpr uint8_t stepBit(BuildStep step)
+{
+    return uint8_t(1u << static_cast<unsigned>(step));
+}
+
+// "Abstract Builder"
+class PizzaBuilder
+{
+public:
+    virtual ~PizzaBuilder() {};
+
+    Pizza* getPizza()
+    {
+        return m_pizza.get();
+    }
+    /* Hands the finished product to the caller, who then owns it; the
+     * builder keeps nothing until the next createNewPizzaProduct. */
+    PizzaPtr releasePizza()
+    {
+        return move(m_pizza);
+    }
+    // Continues building a product started elsewhere, e.g. an earlier pipeline station
+    void adoptPizza(PizzaPtr pizza)
+    {
+        m_pizza = move(pizza);
+    }
+    /* Runs one build step on a pizza owned elsewhere, e.g. a LazyPizza. The
+     * builder's own product is put back afterwards, so getPizza() and
+     * Cook::openPizza still see what the builder last built. */
+    void applyStep(BuildStep step, Pizza& pizza)
+    {
+        bool hadProduct = m_pizza != nullptr;
+        if (!hadProduct)
+            createNewPizzaProduct();
+        Pizza current = *m_pizza;
+        *m_pizza = pizza;
+        buildStep(step);
+        pizza = *m_pizza;
+        if (hadProduct)
+            *m_pizza = current;
+        else
+            m_pizza.reset();
+    }
+    // Products come from the pool, and an unreleased product goes back to it
+    void setPizzaPool(PizzaPool* pool)
+    {
+        m_pizza.reset();
+        m_pool = pool;
+    }
+    /* Arena mode: products are allocated from the given resource instead
+     * of the heap. The current product is dropped, since it may live in a
+     * resource the caller is about to release. */
+    void setMemoryResource(pmr::memory_resource* resource)
+    {
+        m_pizza.reset();
+        m_resource = resource;
+    }
+    void createNewPizzaProduct()
+    {
+        if (m_pool) {
+            m_pool->release(move(m_pizza));
+            m_pizza = m_pool->acquire();
+            return;
+        }
+        if (!m_resource) {
+            m_pizza = PizzaPtr(new Pizza);
+            return;
+        }
+        void* memory = m_resource->allocate(sizeof(Pizza), alignof(Pizza));
+        m_pizza = PizzaPtr(new (memory) Pizza, PizzaDeleter{m_resource});
+    }
+    virtual void buildDough() = 0;
+    virtual void buildSauce() = 0;
+    virtual void buildTopping() = 0;
+    /* A fresh builder of the same recipe, so each worker thread can build
+     * into its own m_pizza instead of sharing one. */
+    virtual unique_ptr<PizzaBuilder> clone() const = 0;
+    /* A deterministic builder produces the same Pizza every time, which
+     * lets PizzaPrototypeCache build it once and hand out copies. */
+    virtual bool isDeterministic() const
+    {
+        return true;
+    }
+    // Recipe name used in reports such as the step profile
+    virtual const char* name() const = 0;
+    /* Steps that must finish before the given one may start. The default is
+     * the classic dough -> sauce -> topping chain; a builder that declares
+     * steps independent must keep them writing disjoint parts of the
+     * product, since StepScheduler may run them at the same time. */
+    virtual uint8_t prerequisites(BuildStep step) const
+    {
+        switch (step) {
+        case BuildStep::Sauce:
+            return stepBit(BuildStep::Dough);
+        case BuildStep::Topping:
+            return stepBit(BuildStep::Sauce);
+        default:
+            return 0;
+        }
+    }
+    void buildStep(BuildStep step)
+    {
+        switch (step) {
+        case BuildStep::Dough:
+            buildDough();
+            break;
+        case BuildStep::Sauce:
+            buildSauce();
+            break;
+        case BuildStep::Topping:
+            buildTopping();
+            break;
+        }
+    }
+protected:
+    PizzaPtr m_pizza;
+    pmr::memory_resource* m_resource = nullptr;
+    PizzaPool* m_pool = nullptr;
+};
+
+//----------------------------------------------------------------
+
+class HawaiianPizzaBuilder : public PizzaBuilder
+{
+public:
+    virtual ~HawaiianPizzaBuilder() {};
+
+    virtual void buildDough()
+    {
+        m_pizza->setDough(Ingredient::Cross);
+    }
+    virtual void buildSauce()
+    {
+        m_pizza->setSauce(Ingredient::Mild);
+    }
+    virtual void buildTopping()
+    {
+        m_pizza->setToppings({ Topping::Ham, Topping::Pineapple });
+    }
+    virtual unique_ptr<PizzaBuilder> clone() const
+    {
+        return make_unique<HawaiianPizzaBuilder>();
+    }
+    virtual const char* name() const
+    {
+        return "hawaiian";
+    }
+};
+
+class SpicyPizzaBuilder : public PizzaBuilder
+{
+public:
+    virtual ~SpicyPizzaBuilder() {};
+
+    virtual void buildDough()
+    {
+        m_pizza->setDough(Ingredient::PanBaked);
+    }
+    virtual void buildSauce()
+    {
+        m_pizza->setSauce(Ingredient::Hot);
+    }
+    virtual void buildTopping()
+    {
+        m_pizza->setToppings({ Topping::Pepperoni, Topping::Salami });
+    }
+    virtual unique_ptr<PizzaBuilder> clone() const
+    {
+        return make_unique<SpicyPizzaBuilder>();
+    }
+    virtual const char* name() const
+    {
+        return "spicy";
+    }
+};
+
+//----------------------------------------------------------------
+
+/* A builder driven by data instead of code: the recipe is just two
+ * ingredient ids and a topping set, so menus can add recipes without new
+ * subclasses. */
+class TablePizzaBuilder : public PizzaBuilder
+{
+public:
+    TablePizzaBuilder(IngredientId dough, IngredientId sauce, ToppingSet toppings)
+        : m_dough(dough), m_sauce(sauce), m_toppings(toppings) {}
+    virtual ~TablePizzaBuilder() {};
+
+    virtual void buildDough()
+    {
+        m_pizza->setDough(m_dough);
+    }
+    virtual void buildSauce()
+    {
+        m_pizza->setSauce(m_sauce);
+    }
+    virtual void buildTopping()
+    {
+        m_pizza->setToppings(m_toppings);
+    }
+    virtual unique_ptr<PizzaBuilder> clone() const
+    {
+        return make_unique<TablePizzaBuilder>(m_dough, m_sauce, m_toppings);
+    }
+    virtual const char* name() const
+    {
+        return "table";
+    }
+    // Each step stores one field, so none of them depends on another
+    virtual uint8_t prerequisites(BuildStep) const
+    {
+        return 0;
+    }
+private:
+    IngredientId m_dough;
+    IngredientId m_sauce;
+    ToppingSet m_toppings;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile()
+    {
+        close();
+    }
+    bool open(const char* path)
+    {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                m_data = static_cast<const char*>(data);
+                m_size = info.st_size;
+            }
+        }
+        ::close(fd);
+        return m_data != nullptr;
+    }
+    void close()
+    {
+        if (m_data)
+            munmap(const_cast<char*>(m_data), m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+    const char* data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+/* Binary menu file, laid out so it can be used straight from an mmap:
+ *
+ *     MenuHeader
+ *     uint32_t   displacement[bucketCount]
+ *     MenuRecipe recipes[recipeCount]      (slot i holds the recipe whose name hashes to i)
+ *     FileString toppings[toppingCount]    (names of the bits in MenuRecipe::toppings)
+ *     char       strings[stringsSize]
+ *
+ * Names are found with a hash-and-displace perfect hash: a recipe's bucket
+ * is hash(name, 0) % bucketCount and its slot is
+ * hash(name, displacement[bucket]) % recipeCount, so a lookup is two hashes
+ * and one string compare. Opening the menu only interns the few distinct
+ * topping names, never anything per recipe. */
+struct FileString
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct MenuRecipe
+{
+    FileString name;
+    FileString dough;
+    FileString sauce;
+    uint16_t toppings; // bit i is the file's topping i
+    uint16_t reserved;
+};
+
+struct MenuHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t recipeCount;
+    uint32_t bucketCount;
+    uint32_t stringsSize;
+    uint32_t toppingCount;
+};
+
+constexpr char menuMagic[4] = { 'M', 'E', 'N', 'U' };
+constexpr uint32_t menuVersion = 2;
+
+inline uint32_t menuHash(string_view key, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ (seed * 16777619u);
+    for (char c : key)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    return hash ^ (hash >> 15);
+}
+
+struct RecipeSpec
+{
+    string name;
+    string dough;
+    string sauce;
+    string topping;
+};
+
+/* Builds the perfect hash and writes the menu; fails on duplicate names,
+ * on more new toppings than fit beside the fixed ones, or on I/O errors */
+bool writeMenuFile(const char* path, const vector<RecipeSpec>& recipes)
+{
+    uint32_t recipeCount = static_cast<uint32_t>(recipes.size());
+    uint32_t bucketCount = max<uint32_t>(recipeCount / 4, 1);
+
+    unordered_set<string_view> names;
+    vector<vector<uint32_t>> buckets(bucketCount);
+    // The file's topping table, in first-seen order, and each recipe's bits over it
+    vector<string_view> toppingNames;
+    vector<uint16_t> toppingBits(recipeCount, 0);
+    size_t newToppings = 0;
+    for (uint32_t i = 0; i < recipeCount; i++) {
+        if (!names.insert(recipes[i].name).second)
+            return false;
+        buckets[menuHash(recipes[i].name, 0) % bucketCount].push_back(i);
+        for (string_view text = recipes[i].topping; !text.empty();) {
+            size_t plus = text.find('+');
+            string_view topping = text.substr(0, plus);
+            text = plus == string_view::npos ? string_view() : text.substr(plus + 1);
+            if (topping.empty())
+                continue;
+            size_t bit = find(toppingNames.begin(), toppingNames.end(), topping) - toppingNames.begin();
+            if (bit == toppingNames.size()) {
+                if (find(begin(ToppingTable::fixedNames), end(ToppingTable::fixedNames), topping)
+                        == end(ToppingTable::fixedNames)
+                    && ++newToppings > ToppingTable::capacity - size(ToppingTable::fixedNames))
+                    return false;
+                toppingNames.push_back(topping);
+            }
+            toppingBits[i] |= uint16_t(1u << bit);
+        }
+    }
+    vector<uint32_t> order(bucketCount);
+    for (uint32_t b = 0; b < bucketCount; b++)
+        order[b] = b;
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    // Place the biggest buckets first, searching each for a displacement
+    // that sends all of its names to free slots
+    vector<uint32_t> displacement(bucketCount, 0);
+    vector<int64_t> slotOwner(recipeCount, -1);
+    vector<uint32_t> slots;
+    for (uint32_t b : order) {
+        if (buckets[b].empty())
+            continue;
+        for (uint32_t d = 1;; d++) {
+            slots.clear();
+            bool fits = true;
+            for (uint32_t recipe : buckets[b]) {
+                uint32_t slot = menuHash(recipes[recipe].name, d) % recipeCount;
+                if (slotOwner[slot] >= 0 || find(slots.begin(), slots.end(), slot) != slots.end()) {
+                    fits = false;
+                    break;
+                }
+                slots.push_back(slot);
+            }
+            if (!fits)
+                continue;
+            displacement[b] = d;
+            for (size_t i = 0; i < slots.size(); i++)
+                slotOwner[slots[i]] = buckets[b][i];
+            break;
+        }
+    }
+
+    string strings;
+    auto addString = [&](string_view text) {
+        FileString ref = { static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(text.size()) };
+        strings += text;
+        return ref;
+    };
+    vector<MenuRecipe> table(recipeCount);
+    for (uint32_t slot = 0; slot < recipeCount; slot++) {
+        const RecipeSpec& recipe = recipes[slotOwner[slot]];
+        table[slot] = { addString(recipe.name), addString(recipe.dough), addString(recipe.sauce),
+                        toppingBits[slotOwner[slot]], 0 };
+    }
+    vector<FileString> toppingTable;
+    for (string_view name : toppingNames)
+        toppingTable.push_back(addString(name));
+
+    MenuHeader header = {};
+    memcpy(header.magic, menuMagic, sizeof(menuMagic));
+    header.version = menuVersion;
+    header.recipeCount = recipeCount;
+    header.bucketCount = bucketCount;
+    header.stringsSize = static_cast<uint32_t>(strings.size());
+    header.toppingCount = static_cast<uint32_t>(toppingTable.size());
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+           && fwrite(displacement.data(), sizeof(uint32_t), bucketCount, file) == bucketCount
+           && fwrite(table.data(), sizeof(MenuRecipe), recipeCount, file) == recipeCount
+           && fwrite(toppingTable.data(), sizeof(FileString), toppingTable.size(), file) == toppingTable.size()
+           && fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+    return fclose(file) == 0 && ok;
+}
+
+/* Recipe registry backed by a mapped menu file. open() maps and validates
+ * the file and interns its topping table, failing when those toppings do
+ * not fit in the ToppingTable; a builder is made for a recipe when it is
+ * looked up, interning just that recipe's dough and sauce. */
+class MenuFile
+{
+public:
+    bool open(const char* path)
+    {
+        // Every failure also drops the mapping, leaving the object as if never opened
+        auto fail = [this] {
+            m_file.close();
+            return false;
+        };
+        m_header = nullptr;
+        m_displacement = nullptr;
+        m_recipes = nullptr;
+        m_strings = nullptr;
+        if (!m_file.open(path))
+            return fail();
+        const char* data = m_file.data();
+        size_t size = m_file.size();
+        if (size < sizeof(MenuHeader))
+            return fail();
+        const MenuHeader* header = reinterpret_cast<const MenuHeader*>(data);
+        if (memcmp(header->magic, menuMagic, sizeof(menuMagic)) != 0
+            || header->version != menuVersion || header->bucketCount == 0)
+            return fail();
+        if (header->toppingCount > ToppingTable::capacity)
+            return fail();
+        size_t tables = sizeof(MenuHeader) + size_t(header->bucketCount) * sizeof(uint32_t)
+                      + size_t(header->recipeCount) * sizeof(MenuRecipe)
+                      + size_t(header->toppingCount) * sizeof(FileString);
+        if (tables + header->stringsSize > size)
+            return fail();
+        const uint32_t* displacement = reinterpret_cast<const uint32_t*>(data + sizeof(MenuHeader));
+        const MenuRecipe* recipes = reinterpret_cast<const MenuRecipe*>(displacement + header->bucketCount);
+        const FileString* toppingRefs = reinterpret_cast<const FileString*>(recipes + header->recipeCount);
+        const char* strings = data + tables;
+        string_view toppingNames[ToppingTable::capacity];
+        for (uint32_t bit = 0; bit < header->toppingCount; bit++) {
+            const FileString& ref = toppingRefs[bit];
+            if (size_t(ref.offset) + ref.length > header->stringsSize)
+                return fail();
+            toppingNames[bit] = string_view(strings + ref.offset, ref.length);
+        }
+        if (!ToppingTable::instance().tryInternAll(toppingNames, header->toppingCount, m_localToppings))
+            return fail();
+        m_displacement = displacement;
+        m_recipes = recipes;
+        m_strings = strings;
+        m_header = header;
+        return true;
+    }
+    size_t size() const
+    {
+        return m_header ? m_header->recipeCount : 0;
+    }
+    const MenuRecipe* find(string_view name) const
+    {
+        if (size() == 0)
+            return nullptr;
+        uint32_t bucket = menuHash(name, 0) % m_header->bucketCount;
+        uint32_t slot = menuHash(name, m_displacement[bucket]) % m_header->recipeCount;
+        const MenuRecipe& recipe = m_recipes[slot];
+        return text(recipe.name) == name ? &recipe : nullptr;
+    }
+    string_view text(const FileString& ref) const
+    {
+        if (!m_header || size_t(ref.offset) + ref.length > m_header->stringsSize)
+            return {};
+        return string_view(m_strings + ref.offset, ref.length);
+    }
+    // nullptr for an unknown name, or when the ingredient table is full
+    unique_ptr<PizzaBuilder> makeBuilder(string_view name) const
+    {
+        const MenuRecipe* recipe = find(name);
+        if (!recipe)
+            return nullptr;
+        IngredientTable& table = IngredientTable::instance();
+        IngredientId dough, sauce;
+        if (!table.tryIntern(text(recipe->dough), dough) || !table.tryIntern(text(recipe->sauce), sauce))
+            return nullptr;
+        ToppingSet toppings;
+        for (uint32_t bit = 0; bit < m_header->toppingCount; bit++)
+            if (recipe->toppings >> bit & 1)
+                toppings.add(m_localToppings[bit]);
+        return make_unique<TablePizzaBuilder>(dough, sauce, toppings);
+    }
+private:
+    MappedFile m_file;
+    Topping m_localToppings[ToppingTable::capacity] = {};
+    const MenuHeader* m_header = nullptr;
+    const uint32_t* m_displacement = nullptr;
+    const MenuRecipe* m_recipes = nullptr;
+    const char* m_strings = nullptr;
+};
+
+/* Binary batch of finished pizzas, written in one writev and read back
+ * in place from an mmap:
+ *
+ *     PizzaFileHeader
+ *     FileString  names[ingredientCount + toppingCount]  (ingredient ids, then topping bits)
+ *     char        text[namesSize], zero-padded to a multiple of 8
+ *     PizzaRecord records[pizzaCount]
+ *
+ * A record is the in-memory Pizza itself, so writing copies nothing.
+ * Record ids and topping bits index the file's own name lists, which lets
+ * another process read them; values are in native byte order. */
+struct PizzaRecord
+{
+    IngredientId dough;
+    IngredientId sauce;
+    uint16_t toppings;
+};
+static_assert(sizeof(PizzaRecord) == sizeof(Pizza) && is_trivially_copyable_v<Pizza>,
+              "PizzaRecord must mirror Pizza's layout");
+
+struct PizzaFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t pizzaCount;
+    uint32_t ingredientCount;
+    uint32_t toppingCount;
+    uint32_t namesSize;
+    uint32_t reserved;
+};
+
+constexpr char pizzaFileMagic[4] = { 'P', 'Z', 'Z', 'A' };
+constexpr uint32_t pizzaFileVersion = 2;
+
+bool writePizzaFile(const char* path, const Pizza* pizzas, size_t count)
+{
+    // The file carries the whole ingredient and topping tables, so ids and bits are written unchanged
+    const IngredientTable& ingredientTable = IngredientTable::instance();
+    const ToppingTable& toppingTable = ToppingTable::instance();
+    size_t ingredientCount = ingredientTable.size(), toppingCount = toppingTable.size();
+    vector<FileString> refs;
+    string names;
+    auto addName = [&](const string& name) {
+        refs.push_back({ static_cast<uint32_t>(names.size()), static_cast<uint32_t>(name.size()) });
+        names += name;
+    };
+    for (size_t id = 0; id < ingredientCount; id++)
+        addName(ingredientTable.name(static_cast<IngredientId>(id)));
+    for (size_t bit = 0; bit < toppingCount; bit++)
+        addName(toppingTable.name(static_cast<Topping>(bit)));
+    names.resize((names.size() + 7) / 8 * 8, '\0');
+
+    PizzaFileHeader header = {};
+    memcpy(header.magic, pizzaFileMagic, sizeof(pizzaFileMagic));
+    header.version = pizzaFileVersion;
+    header.pizzaCount = count;
+    header.ingredientCount = static_cast<uint32_t>(ingredientCount);
+    header.toppingCount = static_cast<uint32_t>(toppingCount);
+    header.namesSize = static_cast<uint32_t>(names.size());
+
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    iovec parts[4] = { { &header, sizeof(header) },
+                       { refs.data(), refs.size() * sizeof(FileString) },
+                       { names.data(), names.size() },
+                       { const_cast<Pizza*>(pizzas), count * sizeof(Pizza) } };
+    bool ok = writeFully(fd, parts, 4);
+    return ::close(fd) == 0 && ok;
+}
+
+/* Maps a pizza file and exposes its records where they lie. pizza() turns
+ * a record back into a Pizza of this process, translating the file's
+ * ingredient ids and topping bits through tables built once in open(). */
+class PizzaFile
+{
+public:
+    bool open(const char* path)
+    {
+        // Every failure also drops the mapping, leaving the object as if never opened
+        auto fail = [this] {
+            m_file.close();
+            return false;
+        };
+        m_header = nullptr;
+        m_records = nullptr;
+        if (!m_file.open(path) || m_file.size() < sizeof(PizzaFileHeader))
+            return fail();
+        const char* data = m_file.data();
+        const PizzaFileHeader* header = reinterpret_cast<const PizzaFileHeader*>(data);
+        if (memcmp(header->magic, pizzaFileMagic, sizeof(pizzaFileMagic)) != 0
+            || header->version != pizzaFileVersion || header->toppingCount > ToppingTable::capacity)
+            return fail();
+        size_t nameCount = size_t(header->ingredientCount) + header->toppingCount;
+        size_t namesOffset = sizeof(PizzaFileHeader) + nameCount * sizeof(FileString);
+        size_t recordsOffset = namesOffset + header->namesSize;
+        if (recordsOffset > m_file.size()
+            || header->pizzaCount > (m_file.size() - recordsOffset) / sizeof(PizzaRecord))
+            return fail();
+
+        const FileString* refs = reinterpret_cast<const FileString*>(data + sizeof(PizzaFileHeader));
+        for (size_t i = 0; i < nameCount; i++)
+            if (size_t(refs[i].offset) + refs[i].length > header->namesSize)
+                return fail();
+        auto name = [&](size_t i) { return string_view(data + namesOffset + refs[i].offset, refs[i].length); };
+
+        // Toppings first and all at once: when they do not fit beside the ones
+        // already known, the open fails without taking any bits
+        vector<string_view> toppingNames(header->toppingCount);
+        for (uint32_t bit = 0; bit < header->toppingCount; bit++)
+            toppingNames[bit] = name(header->ingredientCount + bit);
+        m_localToppings.resize(header->toppingCount);
+        if (!ToppingTable::instance().tryInternAll(toppingNames.data(), toppingNames.size(), m_localToppings.data()))
+            return fail();
+        IngredientTable& ingredientTable = IngredientTable::instance();
+        m_localIds.resize(header->ingredientCount);
+        for (uint32_t id = 0; id < header->ingredientCount; id++)
+            if (!ingredientTable.tryIntern(name(id), m_localIds[id]))
+                return fail();
+
+        m_records = reinterpret_cast<const PizzaRecord*>(data + recordsOffset);
+        m_header = header;
+        return true;
+    }
+    size_t size() const
+    {
+        return m_header ? m_header->pizzaCount : 0;
+    }
+    const PizzaRecord* records() const
+    {
+        return m_records;
+    }
+    Pizza pizza(size_t index) const
+    {
+        const PizzaRecord& record = m_records[index];
+        Pizza pizza;
+        pizza.setDough(localId(record.dough));
+        pizza.setSauce(localId(record.sauce));
+        ToppingSet toppings;
+        for (size_t bit = 0; bit < m_localToppings.size(); bit++)
+            if (record.toppings >> bit & 1)
+                toppings.add(m_localToppings[bit]);
+        pizza.setToppings(toppings);
+        return pizza;
+    }
+private:
+    IngredientId localId(IngredientId fileId) const
+    {
+        return fileId < m_localIds.size() ? m_localIds[fileId] : Ingredient::None;
+    }
+
+    MappedFile m_file;
+    const PizzaFileHeader* m_header = nullptr;
+    const PizzaRecord* m_records = nullptr;
+    vector<IngredientId> m_localIds;
+    vector<Topping> m_localToppings;
+};
+
+//----------------------------------------------------------------
+
+/* "Static Builder": the same recipe steps bound at compile time (CRTP).
+ * Cook's template overloads call them without a virtual dispatch, so a
+ * known recipe compiles down to straight-line stores into the product. */
+template <typename Derived>
+class StaticPizzaBuilder
+{
+public:
+    constexpr const Derived& derived() const
+    {
+        return static_cast<const Derived&>(*this);
+    }
+    // All three steps on a fresh product; usable in constant expressions
+    constexpr Pizza make() const
+    {
+        const Derived& builder = derived();
+        Pizza pizza;
+        builder.buildDough(pizza);
+        builder.buildSauce(pizza);
+        builder.buildTopping(pizza);
+        return pizza;
+    }
+};
+
+class StaticHawaiianPizzaBuilder : public StaticPizzaBuilder<StaticHawaiianPizzaBuilder>
+{
+public:
+    static constexpr string_view name = "hawaiian";
+
+    constexpr void buildDough(Pizza& pizza) const
+    {
+        pizza.setDough(Ingredient::Cross);
+    }
+    constexpr void buildSauce(Pizza& pizza) const
+    {
+        pizza.setSauce(Ingredient::Mild);
+    }
+    constexpr void buildTopping(Pizza& pizza) const
+    {
+        pizza.setToppings({ Topping::Ham, Topping::Pineapple });
+    }
+};
+
+class StaticSpicyPizzaBuilder : public StaticPizzaBuilder<StaticSpicyPizzaBuilder>
+{
+public:
+    static constexpr string_view name = "spicy";
+
+    constexpr void buildDough(Pizza& pizza) const
+    {
+        pizza.setDough(Ingredient::PanBaked);
+    }
+    constexpr void buildSauce(Pizza& pizza) const
+    {
+        pizza.setSauce(Ingredient::Hot);
+    }
+    constexpr void buildTopping(Pizza& pizza) const
+    {
+        pizza.setToppings({ Topping::Pepperoni, Topping::Salami });
+    }
+};
+
+/* The static recipes evaluated into a table at compile time: the table is
+ * constexpr and built by a consteval function, so nothing runs at startup
+ * and serving an order from it is a copy. Names are stored inline rather
+ * than as pointers, so the table needs no relocations and the linker puts
+ * it in .rodata. */
+struct StaticMenuEntry
+{
+    char name[16];
+    Pizza pizza;
+
+    constexpr string_view recipe() const
+    {
+        return string_view(name);
+    }
+};
+
+template <typename Builder>
+constexpr StaticMenuEntry makeStaticMenuEntry(const StaticPizzaBuilder<Builder>& pb)
+{
+    StaticMenuEntry entry{};
+    if (Builder::name.size() >= sizeof(entry.name))
+        throw length_error("static recipe name too long");
+    copy(Builder::name.begin(), Builder::name.end(), entry.name);
+    entry.pizza = pb.make();
+    return entry;
+}
+
+template <typename... Builders>
+consteval array<StaticMenuEntry, sizeof...(Builders)> makeStaticMenu()
+{
+    return { makeStaticMenuEntry(Builders())... };
+}
+
+constexpr auto staticMenu = makeStaticMenu<StaticHawaiianPizzaBuilder, StaticSpicyPizzaBuilder>();
+
+constexpr const StaticMenuEntry* findStaticRecipe(string_view name)
+{
+    for (const StaticMenuEntry& entry : staticMenu)
+        if (entry.recipe() == name)
+            return &entry;
+    return nullptr;
+}
+
+static_assert(findStaticRecipe("hawaiian")->pizza.toppings() == ToppingSet{ Topping::Ham, Topping::Pineapple });
+static_assert(findStaticRecipe("spicy")->pizza.sauce() == Ingredient::Hot);
+static_assert(findStaticRecipe("margherita") == nullptr);
+
+// True when the page holding the address is mapped without write permission
+bool isReadOnlyMapping(const void* address)
+{
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (!maps)
+        return false;
+    uintptr_t target = reinterpret_cast<uintptr_t>(address);
+    bool readOnly = false;
+    char line[4096];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long begin, end;
+        char permissions[5];
+        if (sscanf(line, "%lx-%lx %4s", &begin, &end, permissions) == 3 && target >= begin && target < end) {
+            readOnly = permissions[0] == 'r' && permissions[1] != 'w';
+            break;
+        }
+    }
+    fclose(maps);
+    return readOnly;
+}
+
+//----------------------------------------------------------------
+
+/* A batch owns one monotonic arena: every Pizza in it is carved from the
+ * arena and the whole region is handed back at once by reset() or the
+ * destructor. Pizza is trivially destructible, so that costs O(1). */
+class PizzaBatch
+{
+public:
+    explicit PizzaBatch(size_t initialBytes = 64 * 1024)
+        : m_arena(initialBytes), m_pizzas(&m_arena) {}
+
+    pmr::vector<Pizza>& pizzas()
+    {
+        return m_pizzas;
+    }
+    pmr::memory_resource* resource()
+    {
+        return &m_arena;
+    }
+    void reset()
+    {
+        pmr::vector<Pizza>(&m_arena).swap(m_pizzas);
+        m_arena.release();
+    }
+private:
+    pmr::monotonic_buffer_resource m_arena;
+    pmr::vector<Pizza> m_pizzas; // declared after m_arena so it dies first
+};
+
+/* Lazy product: records the recipe and runs a build step only when its
+ * field is first read, together with the steps the builder lists as its
+ * prerequisites, so a consumer that only checks the sauce never pays for
+ * the topping. materialize() forces the remaining steps. The
+ * recipe's builder is borrowed: it must outlive the pizza and must not be
+ * used from another thread while fields are being read. */
+class LazyPizza
+{
+public:
+    explicit LazyPizza(PizzaBuilder* recipe) : m_recipe(recipe) {}
+
+    IngredientId dough() const
+    {
+        build(BuildStep::Dough);
+        return m_pizza.dough();
+    }
+    IngredientId sauce() const
+    {
+        build(BuildStep::Sauce);
+        return m_pizza.sauce();
+    }
+    ToppingSet toppings() const
+    {
+        build(BuildStep::Topping);
+        return m_pizza.toppings();
+    }
+    const Pizza& materialize() const
+    {
+        dough();
+        sauce();
+        toppings();
+        return m_pizza;
+    }
+    void open() const
+    {
+        materialize().open();
+    }
+private:
+    // Runs the step after whatever it transitively waits for
+    void build(BuildStep target) const
+    {
+        uint8_t wanted = stepBit(target);
+        for (size_t round = 0; round < buildStepCount; round++)
+            for (size_t step = 0; step < buildStepCount; step++)
+                if (wanted & stepBit(BuildStep(step)))
+                    wanted |= m_recipe->prerequisites(BuildStep(step));
+        while (wanted & ~m_built) {
+            bool cyclic = true;
+            for (size_t step = 0; step < buildStepCount; step++) {
+                uint8_t bit = stepBit(BuildStep(step));
+                if ((wanted & ~m_built & bit) && !(m_recipe->prerequisites(BuildStep(step)) & ~m_built)) {
+                    m_recipe->applyStep(BuildStep(step), m_pizza);
+                    m_built |= bit;
+                    cyclic = false;
+                }
+            }
+            // Like StepScheduler, a cycle falls back to the usual order
+            for (size_t step = 0; cyclic && step < buildStepCount; step++)
+                if (wanted & ~m_built & stepBit(BuildStep(step))) {
+                    m_recipe->applyStep(BuildStep(step), m_pizza);
+                    m_built |= stepBit(BuildStep(step));
+                }
+        }
+    }
+
+    PizzaBuilder* m_recipe;
+    mutable Pizza m_pizza;
+    mutable uint8_t m_built = 0;
+};
+
+/* Per-step build timing, compiled in only with -DPIZZA_PROFILE. Each
+ * thread records steady_clock durations into its own log-linear
+ * histograms (four sub-buckets per power of two), keyed by builder name
+ * and step, so recording takes no lock. dump() merges every thread's
+ * histograms and prints p50/p99/p999 per builder and step. */
+#ifdef PIZZA_PROFILE
+class StepProfiler
+{
+public:
+    enum Step { CreateProduct, Dough, Sauce, Topping, StepCount };
+
+    static void record(const char* builder, Step step, uint64_t ns)
+    {
+        ThreadProfile& profile = threadProfile();
+        auto it = profile.histograms.find(builder);
+        if (it == profile.histograms.end()) {
+            lock_guard<mutex> lock(profile.lock);
+            it = profile.histograms.try_emplace(builder).first;
+        }
+        atomic<uint64_t>& bucket = it->second[step].buckets[bucketOf(ns)];
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+    static void dump()
+    {
+        static const char* stepNames[StepCount] = { "create", "dough", "sauce", "topping" };
+        map<string, array<array<uint64_t, bucketCount>, StepCount>> merged;
+        {
+            lock_guard<mutex> lock(registryMutex());
+            for (const shared_ptr<ThreadProfile>& profile : registry()) {
+                lock_guard<mutex> profileLock(profile->lock);
+                for (const auto& [builder, steps] : profile->histograms)
+                    for (size_t step = 0; step < StepCount; step++)
+                        for (size_t b = 0; b < bucketCount; b++)
+                            merged[builder][step][b] += steps[step].buckets[b].load(memory_order_relaxed);
+            }
+        }
+        for (const auto& [builder, steps] : merged)
+            for (size_t step = 0; step < StepCount; step++)
+                console() << builder << " " << stepNames[step] << ": p50 "
+                          << percentile(steps[step], 0.5) << " ns, p99 "
+                          << percentile(steps[step], 0.99) << " ns, p999 "
+                          << percentile(steps[step], 0.999) << " ns" << '\n';
+    }
+private:
+    static constexpr size_t bucketCount = 256;
+
+    struct Histogram
+    {
+        atomic<uint64_t> buckets[bucketCount] = {};
+    };
+    using Steps = array<Histogram, StepCount>;
+
+    struct ThreadProfile
+    {
+        mutex lock; // held while adding a builder and while dump() reads
+        map<const char*, Steps> histograms;
+    };
+
+    static size_t bucketOf(uint64_t ns)
+    {
+        if (ns < 16)
+            return ns;
+        unsigned exponent = 63 - __builtin_clzll(ns);
+        return 16 + (exponent - 4) * 4 + ((ns >> (exponent - 2)) & 3);
+    }
+    static uint64_t lowerBound(size_t bucket)
+    {
+        if (bucket < 16)
+            return bucket;
+        unsigned exponent = (bucket - 16) / 4 + 4;
+        return (uint64_t(4 + (bucket - 16) % 4)) << (exponent - 2);
+    }
+    static uint64_t percentile(const array<uint64_t, bucketCount>& buckets, double q)
+    {
+        uint64_t total = 0;
+        for (uint64_t count : buckets)
+            total += count;
+        uint64_t rank = static_cast<uint64_t>(q * total), seen = 0;
+        for (size_t b = 0; b < bucketCount; b++) {
+            seen += buckets[b];
+            if (seen > rank)
+                return lowerBound(b);
+        }
+        return 0;
+    }
+    static ThreadProfile& threadProfile()
+    {
+        // Shared with the registry so a thread's samples outlive the thread
+        thread_local shared_ptr<ThreadProfile> profile = [] {
+            auto created = make_shared<ThreadProfile>();
+            lock_guard<mutex> lock(registryMutex());
+            registry().push_back(created);
+            return created;
+        }();
+        return *profile;
+    }
+    static vector<shared_ptr<ThreadProfile>>& registry()
+    {
+        static vector<shared_ptr<ThreadProfile>> profiles;
+        return profiles;
+    }
+    static mutex& registryMutex()
+    {
+        static mutex registryLock;
+        return registryLock;
+    }
+};
+
+#define PIZZA_PROFILE_STEP(builder, step, call)                                            \
+    do {                                                                                   \
+        auto profileStart = chrono::steady_clock::now();                                   \
+        call;                                                                              \
+        StepProfiler::record((builder)->name(), StepProfiler::step,                        \
+            chrono::duration_cast<chrono::nanoseconds>(                                    \
+                chrono::steady_clock::now() - profileStart).count());                      \
+    } while (0)
+#else
+#define PIZZA_PROFILE_STEP(builder, step, call) call
+#endif
+
+class Cook
+{
+public:
+    void openPizza()
+    {
+        m_pizzaBuilder->getPizza()->open();
+    }
+    void makePizza(PizzaBuilder* pb)
+    {
+        m_pizzaBuilder = pb;
+        PIZZA_PROFILE_STEP(pb, CreateProduct, m_pizzaBuilder->createNewPizzaProduct());
+        PIZZA_PROFILE_STEP(pb, Dough, m_pizzaBuilder->buildDough());
+        PIZZA_PROFILE_STEP(pb, Sauce, m_pizzaBuilder->buildSauce());
+        PIZZA_PROFILE_STEP(pb, Topping, m_pizzaBuilder->buildTopping());
+    }
+    // Lazy mode: nothing is built until a field of the pizza is read
+    LazyPizza makeLazyPizza(PizzaBuilder* pb) const
+    {
+        return LazyPizza(pb);
+    }
+    /* Batch production: the builder runs its steps once and the finished
+     * product is copied into every slot of a contiguous output range, so a
+     * batch costs one builder dispatch instead of one per pizza. */
+    void makePizzas(PizzaBuilder* pb, Pizza* out, size_t n)
+    {
+        makePizza(pb);
+        const Pizza& prototype = *m_pizzaBuilder->getPizza();
+        for (size_t i = 0; i < n; i++)
+            out[i] = prototype;
+    }
+    vector<Pizza> makePizzas(PizzaBuilder* pb, size_t n)
+    {
+        makePizza(pb);
+        return vector<Pizza>(n, *m_pizzaBuilder->getPizza());
+    }
+    void makePizzas(PizzaBuilder* pb, PizzaBatch& batch, size_t n)
+    {
+        makePizza(pb);
+        batch.pizzas().assign(n, *m_pizzaBuilder->getPizza());
+    }
+    // Static dispatch: same steps, resolved at compile time
+    template <typename Builder>
+    Pizza makePizza(const StaticPizzaBuilder<Builder>& pb) const
+    {
+        return pb.make();
+    }
+    // Closed set of recipes dispatched through std::visit
+    template <typename... Builders>
+    Pizza makePizza(const variant<Builders...>& pb) const
+    {
+        return visit([this](const auto& builder) { return makePizza(builder); }, pb);
+    }
+    template <typename Builder>
+    void makePizzas(const StaticPizzaBuilder<Builder>& pb, Pizza* out, size_t n) const
+    {
+        for (size_t i = 0; i < n; i++)
+            out[i] = makePizza(pb);
+    }
+private:
+    PizzaBuilder* m_pizzaBuilder;
+};
+
+//----------------------------------------------------------------
+
+/* Memoizes each deterministic recipe: the first order runs the builder,
+ * later orders get a copy of that prototype. A Pizza is a few bytes, so a
+ * copy is cheaper than sharing one instance behind a reference count.
+ * Builders that report isDeterministic() == false always run, and any
+ * prototype cached for them earlier is dropped. Entries are keyed by the
+ * builder's address: call invalidate() before a builder is destroyed. */
+class PizzaPrototypeCache
+{
+public:
+    Pizza makePizza(PizzaBuilder* pb)
+    {
+        if (!pb->isDeterministic()) {
+            invalidate(pb);
+            m_misses++;
+            m_cook.makePizza(pb);
+            return *pb->getPizza();
+        }
+        auto it = m_prototypes.find(pb);
+        if (it != m_prototypes.end()) {
+            m_hits++;
+            return it->second;
+        }
+        m_misses++;
+        m_cook.makePizza(pb);
+        return m_prototypes.emplace(pb, *pb->getPizza()).first->second;
+    }
+    void invalidate(const PizzaBuilder* pb)
+    {
+        m_prototypes.erase(pb);
+    }
+    void clear()
+    {
+        m_prototypes.clear();
+    }
+    size_t hits() const
+    {
+        return m_hits;
+    }
+    size_t misses() const
+    {
+        return m_misses;
+    }
+private:
+    Cook m_cook;
+    unordered_map<const PizzaBuilder*, Pizza> m_prototypes;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
+
+//----------------------------------------------------------------
+
+/* CPUs grouped by NUMA node, limited to the CPUs this process may run on.
+ * Read from /sys/devices/system/node; a machine or container without it
+ * is treated as a single node holding every allowed CPU. */
+struct CpuTopology
+{
+    vector<vector<int>> nodes;
+
+    static CpuTopology detect()
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            for (unsigned cpu = 0; cpu < max(thread::hardware_concurrency(), 1u); cpu++)
+                CPU_SET(cpu, &allowed);
+        CpuTopology topology;
+        if (DIR* dir = opendir("/sys/devices/system/node")) {
+            vector<pair<int, vector<int>>> found;
+            while (dirent* entry = readdir(dir)) {
+                int node;
+                if (sscanf(entry->d_name, "node%d", &node) != 1)
+                    continue;
+                string path = string("/sys/devices/system/node/") + entry->d_name + "/cpulist";
+                vector<int> cpus = parseCpuList(readLine(path.c_str()), allowed);
+                if (!cpus.empty())
+                    found.emplace_back(node, move(cpus));
+            }
+            closedir(dir);
+            sort(found.begin(), found.end());
+            for (auto& node : found)
+                topology.nodes.push_back(move(node.second));
+        }
+        if (topology.nodes.empty()) {
+            vector<int> cpus;
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            if (cpus.empty())
+                cpus.push_back(0);
+            topology.nodes.push_back(move(cpus));
+        }
+        return topology;
+    }
+    size_t cpuCount() const
+    {
+        size_t count = 0;
+        for (const vector<int>& cpus : nodes)
+            count += cpus.size();
+        return count;
+    }
+    // The kernel's list format, e.g. "0-3,8-11"
+    static vector<int> parseCpuList(const string& list, const cpu_set_t& allowed)
+    {
+        vector<int> cpus;
+        const char* p = list.c_str();
+        while (*p) {
+            char* end;
+            long first = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            long last = first;
+            if (*end == '-')
+                last = strtol(end + 1, &end, 10);
+            for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(int(cpu));
+            p = (*end == ',') ? end + 1 : end;
+        }
+        return cpus;
+    }
+private:
+    static string readLine(const char* path)
+    {
+        FILE* file = fopen(path, "r");
+        if (!file)
+            return string();
+        char line[4096] = {};
+        if (!fgets(line, sizeof(line), file))
+            line[0] = '\0';
+        fclose(file);
+        return line;
+    }
+};
+
+struct PoolOptions
+{
+    // Pin each worker to one CPU, spreading the workers over the NUMA nodes
+    bool pinThreads = false;
+    // Size of each worker's arena; 0 leaves the workers without one
+    size_t arenaBytes = 0;
+    /* Run by a worker that found no task, before it goes to sleep; returns
+     * true if it did some work, and the worker then looks for tasks again.
+     * kickIdle() wakes a sleeping worker to run it. */
+    function<bool()> idle;
+};
+
+/* Thread pool with one task deque per worker. A worker pops from the back
+ * of its own deque and, when that is empty, steals from the front of the
+ * others, trying workers on its own NUMA node first. Tasks submitted from
+ * a worker go to that worker's deque; tasks from outside are spread
+ * round-robin. The destructor finishes all submitted work before joining.
+ *
+ * With PoolOptions::pinThreads every worker is pinned before it touches
+ * any memory, so its stack, its arena and whatever it allocates land on
+ * its own node under the kernel's first-touch policy. */
+class WorkStealingPool
+{
+public:
+    using Task = function<void()>;
+
+    explicit WorkStealingPool(size_t workers = thread::hardware_concurrency(),
+                              const PoolOptions& options = PoolOptions())
+        : m_options(options)
+    {
+        workers = max<size_t>(workers, 1);
+        CpuTopology topology;
+        if (m_options.pinThreads) {
+            topology = CpuTopology::detect();
+            m_nodes = topology.nodes.size();
+        }
+        for (size_t i = 0; i < workers; i++) {
+            m_workers.push_back(make_unique<Worker>());
+            if (m_options.pinThreads) {
+                Worker& worker = *m_workers.back();
+                worker.node = i % m_nodes;
+                const vector<int>& cpus = topology.nodes[worker.node];
+                worker.cpu = cpus[(i / m_nodes) % cpus.size()];
+            }
+        }
+        for (size_t i = 0; i < workers; i++) {
+            Worker& worker = *m_workers[i];
+            for (size_t pass = 0; pass < 2; pass++)
+                for (size_t j = 1; j < workers; j++) {
+                    size_t victim = (i + j) % workers;
+                    if ((m_workers[victim]->node == worker.node) == (pass == 0))
+                        worker.victims.push_back(victim);
+                }
+        }
+        for (size_t i = 0; i < workers; i++)
+            m_workers[i]->runner = thread(&WorkStealingPool::run, this, i);
+    }
+    ~WorkStealingPool()
+    {
+        {
+            lock_guard<mutex> lock(m_sleepMutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& worker : m_workers)
+            worker->runner.join();
+    }
+    size_t size() const
+    {
+        return m_workers.size();
+    }
+    size_t nodes() const
+    {
+        return m_nodes;
+    }
+    // CPU the worker is pinned to, or -1 when the pool does not pin
+    int cpuOf(size_t worker) const
+    {
+        return m_workers[worker]->cpu;
+    }
+    /* The calling worker's arena, or nullptr outside a pool with arenas.
+     * Only the task currently running on the worker may use it. */
+    static pmr::monotonic_buffer_resource* localArena()
+    {
+        return t_arena;
+    }
+    void submit(Task task)
+    {
+        size_t index = (t_pool == this) ? t_index : m_next++ % m_workers.size();
+        // Counted before it is visible: a worker may pop and uncount it at once
+        {
+            lock_guard<mutex> lock(m_sleepMutex);
+            m_pending++;
+        }
+        {
+            lock_guard<mutex> lock(m_workers[index]->lock);
+            m_workers[index]->tasks.push_back(move(task));
+        }
+        m_wake.notify_one();
+    }
+    // Has a sleeping worker run the idle hook, e.g. because there is new idle work
+    void kickIdle()
+    {
+        {
+            lock_guard<mutex> lock(m_sleepMutex);
+            m_idleKicked = true;
+        }
+        m_wake.notify_one();
+    }
+private:
+    struct Worker
+    {
+        mutex lock;
+        deque<Task> tasks;
+        thread runner;
+        int cpu = -1;
+        size_t node = 0;
+        vector<size_t> victims;
+    };
+
+    void run(size_t index)
+    {
+        t_pool = this;
+        t_index = index;
+        if (m_workers[index]->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(m_workers[index]->cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+        // Zero-filled here, after pinning, so the pages are first touched on this node
+        vector<byte> arenaBuffer(m_options.arenaBytes);
+        optional<pmr::monotonic_buffer_resource> arena;
+        if (!arenaBuffer.empty()) {
+            arena.emplace(arenaBuffer.data(), arenaBuffer.size());
+            t_arena = &*arena;
+        }
+        Task task;
+        for (;;) {
+            if (popLocal(index, task) || steal(index, task)) {
+                m_pending--;
+                task();
+                task = nullptr;
+                continue;
+            }
+            if (m_options.idle && m_options.idle())
+                continue;
+            unique_lock<mutex> lock(m_sleepMutex);
+            m_wake.wait(lock, [this] { return m_pending > 0 || m_stop || m_idleKicked; });
+            m_idleKicked = false;
+            if (m_stop && m_pending == 0)
+                return;
+        }
+    }
+    bool popLocal(size_t index, Task& task)
+    {
+        Worker& self = *m_workers[index];
+        lock_guard<mutex> lock(self.lock);
+        if (self.tasks.empty())
+            return false;
+        task = move(self.tasks.back());
+        self.tasks.pop_back();
+        return true;
+    }
+    bool steal(size_t thief, Task& task)
+    {
+        for (size_t index : m_workers[thief]->victims) {
+            Worker& victim = *m_workers[index];
+            lock_guard<mutex> lock(victim.lock);
+            if (victim.tasks.empty())
+                continue;
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    PoolOptions m_options;
+    size_t m_nodes = 1;
+    vector<unique_ptr<Worker>> m_workers;
+    atomic<size_t> m_next{0};
+    atomic<size_t> m_pending{0};
+    bool m_stop = false;
+    bool m_idleKicked = false;
+    mutex m_sleepMutex;
+    condition_variable m_wake;
+    static thread_local WorkStealingPool* t_pool;
+    static thread_local size_t t_index;
+    static thread_local pmr::monotonic_buffer_resource* t_arena;
+};
+thread_local WorkStealingPool* WorkStealingPool::t_pool = nullptr;
+thread_local size_t WorkStealingPool::t_index = 0;
+thread_local pmr::monotonic_buffer_resource* WorkStealingPool::t_arena = nullptr;
+
+// An order names the recipe by a prototype builder, which must outlive the order
+struct PizzaOrder
+{
+    const PizzaBuilder* recipe;
+    size_t quantity;
+};
+
+// Speculative prebuilding; a stock of 0 turns it off
+struct PrebuildOptions
+{
+    // Pizzas kept ready per recipe
+    size_t stock = 0;
+    // How many of the most demanded recipes are stocked
+    size_t recipes = 2;
+    // Weight of the latest order in the demand average
+    double smoothing = 0.2;
+};
+
+/* A Kitchen runs a pool of cooks. Each order is cut into chunks that are
+ * built on the workers; every chunk clones the recipe's builder, so no two
+ * threads ever touch the same m_pizza. */
+class Kitchen
+{
+public:
+    // Counted in pizzas
+    struct PrebuildStats
+    {
+        size_t hits = 0;     // served from stock
+        size_t misses = 0;   // built for the order
+        size_t prebuilt = 0;
+        size_t wasted = 0;   // dropped when the recipe left the top recipes
+        size_t stocked = 0;  // ready right now
+    };
+
+    /* With pinned cooks and arenas (see PoolOptions) each chunk of an order
+     * stays on one node: the builder is cloned by the cook that runs the
+     * chunk and builds its product in that cook's arena; only the finished
+     * pizzas are written to the order's result.
+     *
+     * With prebuilding, every order updates an exponentially weighted
+     * average of the demand for its recipe, and idle cooks fill a bounded
+     * stock of the most demanded recipes. Orders take what they can from
+     * stock and only build the rest, so a burst after a quiet spell is
+     * served at the cost of a copy. Recipes are then remembered by their
+     * prototype builder, which must outlive the kitchen. */
+    explicit Kitchen(size_t cooks = thread::hardware_concurrency(), size_t chunkSize = 4096,
+                     const PoolOptions& options = PoolOptions(),
+                     const PrebuildOptions& prebuild = PrebuildOptions())
+        : m_chunkSize(max<size_t>(chunkSize, 1)), m_prebuild(prebuild),
+          m_pool(cooks, withIdleHook(options))
+    {
+    }
+
+    future<vector<Pizza>> submit(const PizzaOrder& order)
+    {
+        struct Pending
+        {
+            vector<Pizza> pizzas;
+            atomic<size_t> chunksLeft;
+            promise<vector<Pizza>> done;
+        };
+        auto pending = make_shared<Pending>();
+        pending->pizzas.resize(order.quantity);
+        size_t fromStock = (m_prebuild.stock > 0) ? takeFromStock(order, pending->pizzas.data()) : 0;
+        size_t chunks = (order.quantity - fromStock + m_chunkSize - 1) / m_chunkSize;
+        pending->chunksLeft = chunks;
+        future<vector<Pizza>> result = pending->done.get_future();
+        if (chunks == 0) {
+            pending->done.set_value(move(pending->pizzas));
+            return result;
+        }
+        for (size_t begin = fromStock; begin < order.quantity; begin += m_chunkSize) {
+            size_t count = min(m_chunkSize, order.quantity - begin);
+            const PizzaBuilder* recipe = order.recipe;
+            m_pool.submit([pending, recipe, begin, count] {
+                unique_ptr<PizzaBuilder> builder = recipe->clone();
+                if (pmr::monotonic_buffer_resource* arena = WorkStealingPool::localArena()) {
+                    arena->release(); // the previous chunk's builder is gone
+                    builder->setMemoryResource(arena);
+                }
+                Cook cook;
+                cook.makePizzas(builder.get(), pending->pizzas.data() + begin, count);
+                if (--pending->chunksLeft == 0)
+                    pending->done.set_value(move(pending->pizzas));
+            });
+        }
+        return result;
+    }
+    size_t cooks() const
+    {
+        return m_pool.size();
+    }
+    size_t nodes() const
+    {
+        return m_pool.nodes();
+    }
+    PrebuildStats prebuildStats() const
+    {
+        lock_guard<mutex> lock(m_stockMutex);
+        PrebuildStats stats = m_stats;
+        for (const auto& demand : m_demand)
+            stats.stocked += demand.second.stock.size();
+        return stats;
+    }
+private:
+    struct Demand
+    {
+        double average = 0;
+        vector<Pizza> stock;
+        size_t building = 0;
+    };
+
+    PoolOptions withIdleHook(PoolOptions options)
+    {
+        if (m_prebuild.stock > 0)
+            options.idle = [this] { return prebuildOne(); };
+        return options;
+    }
+    // Updates the demand and copies what stock has to the front of out
+    size_t takeFromStock(const PizzaOrder& order, Pizza* out)
+    {
+        size_t taken;
+        {
+            lock_guard<mutex> lock(m_stockMutex);
+            for (auto& demand : m_demand)
+                demand.second.average *= 1 - m_prebuild.smoothing;
+            Demand& demand = m_demand[order.recipe];
+            demand.average += m_prebuild.smoothing * order.quantity;
+            taken = min(demand.stock.size(), order.quantity);
+            copy(demand.stock.end() - taken, demand.stock.end(), out);
+            demand.stock.resize(demand.stock.size() - taken);
+            m_stats.hits += taken;
+            m_stats.misses += order.quantity - taken;
+            dropUnpopularStock();
+        }
+        m_pool.kickIdle();
+        return taken;
+    }
+    void dropUnpopularStock()
+    {
+        vector<const PizzaBuilder*> popular = mostDemanded();
+        for (auto& demand : m_demand) {
+            if (demand.second.stock.empty() || find(popular.begin(), popular.end(), demand.first) != popular.end())
+                continue;
+            m_stats.wasted += demand.second.stock.size();
+            demand.second.stock.clear();
+        }
+    }
+    vector<const PizzaBuilder*> mostDemanded() const
+    {
+        vector<pair<double, const PizzaBuilder*>> ranked;
+        for (const auto& demand : m_demand)
+            ranked.emplace_back(demand.second.average, demand.first);
+        size_t top = min(m_prebuild.recipes, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(),
+                     [](const auto& a, const auto& b) { return a.first > b.first; });
+        vector<const PizzaBuilder*> recipes;
+        for (size_t i = 0; i < top; i++)
+            recipes.push_back(ranked[i].second);
+        return recipes;
+    }
+    // Idle hook: builds one pizza of the most demanded recipe whose stock is short
+    bool prebuildOne()
+    {
+        const PizzaBuilder* recipe = nullptr;
+        {
+            lock_guard<mutex> lock(m_stockMutex);
+            for (const PizzaBuilder* candidate : mostDemanded()) {
+                Demand& demand = m_demand[candidate];
+                if (demand.stock.size() + demand.building < m_prebuild.stock) {
+                    recipe = candidate;
+                    demand.building++;
+                    break;
+                }
+            }
+        }
+        if (!recipe)
+            return false;
+        unique_ptr<PizzaBuilder> builder = recipe->clone();
+        Cook cook;
+        cook.makePizza(builder.get());
+        lock_guard<mutex> lock(m_stockMutex);
+        Demand& demand = m_demand[recipe];
+        demand.building--;
+        demand.stock.push_back(*builder->getPizza());
+        m_stats.prebuilt++;
+        return true;
+    }
+
+    size_t m_chunkSize;
+    PrebuildOptions m_prebuild;
+    mutable mutex m_stockMutex;
+    unordered_map<const PizzaBuilder*, Demand> m_demand;
+    PrebuildStats m_stats;
+    // Last, so the cooks are joined before the stock they fill goes away
+    WorkStealingPool m_pool;
+};
+
+//----------------------------------------------------------------
+
+/* Coalesces identical orders. The first order for a recipe opens a group
+ * that stays open for the window; orders for the same recipe that arrive
+ * meanwhile join it. When the window closes one cook builds the recipe
+ * once and every order in the group gets its copies of that pizza. A
+ * longer window saves more builds but adds up to the window to each
+ * order's latency; a zero window builds every order on its own. Pending
+ * groups are built before the destructor returns. */
+class OrderCoalescer
+{
+public:
+    struct Stats
+    {
+        size_t orders = 0;
+        size_t builds = 0;
+        size_t coalesced = 0; // orders that joined an open group
+    };
+
+    explicit OrderCoalescer(chrono::microseconds window, size_t cooks = thread::hardware_concurrency())
+        : m_window(window), m_pool(cooks), m_timer(&OrderCoalescer::closeGroups, this) {}
+    ~OrderCoalescer()
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        m_timer.join();
+    }
+
+    future<vector<Pizza>> submit(const PizzaOrder& order)
+    {
+        auto waiter = make_shared<Waiter>();
+        waiter->quantity = order.quantity;
+        future<vector<Pizza>> result = waiter->done.get_future();
+        if (m_window.count() == 0) {
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_stats.orders++;
+                m_stats.builds++;
+            }
+            auto group = make_shared<Group>();
+            group->recipe = order.recipe;
+            group->waiters.push_back(move(waiter));
+            build(move(group));
+            return result;
+        }
+        lock_guard<mutex> lock(m_mutex);
+        m_stats.orders++;
+        shared_ptr<Group>& group = m_open[order.recipe];
+        if (group) {
+            m_stats.coalesced++;
+            group->waiters.push_back(move(waiter));
+            return result;
+        }
+        group = make_shared<Group>();
+        group->recipe = order.recipe;
+        group->deadline = chrono::steady_clock::now() + m_window;
+        group->waiters.push_back(move(waiter));
+        m_stats.builds++;
+        m_byDeadline.push_back(group);
+        if (m_byDeadline.size() == 1)
+            m_wake.notify_one();
+        return result;
+    }
+    Stats stats() const
+    {
+        lock_guard<mutex> lock(m_mutex);
+        return m_stats;
+    }
+private:
+    struct Waiter
+    {
+        size_t quantity;
+        promise<vector<Pizza>> done;
+    };
+    struct Group
+    {
+        const PizzaBuilder* recipe;
+        chrono::steady_clock::time_point deadline;
+        vector<shared_ptr<Waiter>> waiters;
+    };
+
+    // Timer thread; every group has the same window, so deadlines come in opening order
+    void closeGroups()
+    {
+        unique_lock<mutex> lock(m_mutex);
+        for (;;) {
+            if (m_byDeadline.empty()) {
+                if (m_stop)
+                    return;
+                m_wake.wait(lock);
+                continue;
+            }
+            shared_ptr<Group> group = m_byDeadline.front();
+            if (!m_stop && chrono::steady_clock::now() < group->deadline) {
+                m_wake.wait_until(lock, group->deadline);
+                continue;
+            }
+            m_byDeadline.pop_front();
+            m_open.erase(group->recipe);
+            build(move(group));
+        }
+    }
+    void build(shared_ptr<Group> group)
+    {
+        m_pool.submit([group] {
+            unique_ptr<PizzaBuilder> builder = group->recipe->clone();
+            Cook cook;
+            cook.makePizza(builder.get());
+            const Pizza& pizza = *builder->getPizza();
+            for (const shared_ptr<Waiter>& waiter : group->waiters)
+                waiter->done.set_value(vector<Pizza>(waiter->quantity, pizza));
+        });
+    }
+
+    chrono::microseconds m_window;
+    mutable mutex m_mutex;
+    condition_variable m_wake;
+    unordered_map<const PizzaBuilder*, shared_ptr<Group>> m_open;
+    deque<shared_ptr<Group>> m_byDeadline;
+    Stats m_stats;
+    bool m_stop = false;
+    WorkStealingPool m_pool;
+    thread m_timer;
+};
+
+//----------------------------------------------------------------
+
+/* Runs the build steps of each product as a small dependency graph on a
+ * WorkStealingPool: a step is submitted as soon as the steps its builder
+ * lists in prerequisites() are done. Independent steps of one product
+ * therefore run concurrently, and the products of an order run in
+ * parallel, each with its own clone of the recipe's builder. A recipe
+ * whose prerequisites form a cycle is built step by step in the usual
+ * order instead. */
+class StepScheduler
+{
+public:
+    explicit StepScheduler(size_t threads = thread::hardware_concurrency()) : m_pool(threads) {}
+
+    future<vector<Pizza>> makePizzas(const PizzaBuilder& recipe, size_t count)
+    {
+        auto order = make_shared<Order>();
+        order->pizzas.resize(count);
+        order->productsLeft = count;
+        future<vector<Pizza>> result = order->done.get_future();
+        if (count == 0) {
+            order->done.set_value({});
+            return result;
+        }
+        bool acyclic = isAcyclic(recipe);
+        for (size_t i = 0; i < count; i++) {
+            auto product = make_shared<Product>();
+            product->order = order;
+            product->index = i;
+            product->builder = recipe.clone();
+            product->builder->createNewPizzaProduct();
+            for (size_t step = 0; step < buildStepCount; step++) {
+                uint8_t prerequisites = acyclic ? product->builder->prerequisites(BuildStep(step))
+                                                : uint8_t(stepBit(BuildStep(step)) - 1);
+                product->prerequisites[step] = prerequisites;
+                product->waitingFor[step] = __builtin_popcount(prerequisites);
+            }
+            // Roots come from the declared prerequisites: once the first step
+            // runs, waitingFor may reach 0 for steps its worker submits itself
+            for (size_t step = 0; step < buildStepCount; step++)
+                if (product->prerequisites[step] == 0)
+                    submitStep(product, BuildStep(step));
+        }
+        return result;
+    }
+    size_t threads() const
+    {
+        return m_pool.size();
+    }
+private:
+    struct Order
+    {
+        vector<Pizza> pizzas;
+        atomic<size_t> productsLeft;
+        promise<vector<Pizza>> done;
+    };
+    struct Product
+    {
+        shared_ptr<Order> order;
+        size_t index;
+        unique_ptr<PizzaBuilder> builder;
+        uint8_t prerequisites[buildStepCount];
+        atomic<int> waitingFor[buildStepCount];
+        atomic<size_t> stepsLeft{buildStepCount};
+    };
+
+    void submitStep(const shared_ptr<Product>& product, BuildStep step)
+    {
+        m_pool.submit([this, product, step] {
+            product->builder->buildStep(step);
+            for (size_t next = 0; next < buildStepCount; next++)
+                if ((product->prerequisites[next] & stepBit(step)) && --product->waitingFor[next] == 0)
+                    submitStep(product, BuildStep(next));
+            if (--product->stepsLeft > 0)
+                return;
+            Order& order = *product->order;
+            order.pizzas[product->index] = *product->builder->getPizza();
+            if (--order.productsLeft == 0)
+                order.done.set_value(move(order.pizzas));
+        });
+    }
+    static bool isAcyclic(const PizzaBuilder& recipe)
+    {
+        uint8_t done = 0;
+        for (size_t round = 0; round < buildStepCount; round++)
+            for (size_t step = 0; step < buildStepCount; step++)
+                if ((recipe.prerequisites(BuildStep(step)) & ~done) == 0)
+                    done |= stepBit(BuildStep(step));
+        return done == (1u << buildStepCount) - 1;
+    }
+
+    WorkStealingPool m_pool;
+};
+
+//----------------------------------------------------------------
 
-Solution
-    Define an intermediate object whose member functions define the desired object part by part
-    before the object is available to the client.
-    Builder Pattern lets us defer the construction of the object until all
-    the options for creation have been specified.
- */
-// "Product"
-class Pizza
+/* Bounded lock-free multi-producer/multi-consumer ring buffer (Dmitry
+ * Vyukov's design). Every cell carries a sequence number telling producers
+ * and consumers whose turn it is, so neither side ever takes a lock.
+ * tryPush returns false when the ring is full: that is the backpressure
+ * signal, and the caller decides whether to retry, shed or slow down. */
+template <typename T>
+class MpmcQueue
 {
 public:
-    void setDough(const string& dough)
+    explicit MpmcQueue(size_t capacity)
     {
-        m_dough = dough;
+        size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+        m_mask = size - 1;
+        m_cells = make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; i++)
+            m_cells[i].sequence.store(i, memory_order_relaxed);
     }
-    void setSauce(const string& sauce)
+    size_t capacity() const
     {
-        m_sauce = sauce;
+        return m_mask + 1;
     }
-    void setTopping(const string& topping)
+    size_t sizeApprox() const
     {
-        m_topping = topping;
+        size_t tail = m_enqueuePos.load(memory_order_relaxed);
+        size_t head = m_dequeuePos.load(memory_order_relaxed);
+        return tail > head ? tail - head : 0;
     }
-    void open() const
+    template <typename U>
+    bool tryPush(U&& value)
     {
-        cout << "Pizza with " << m_dough << " dough, " << m_sauce << " sauce and "
-             << m_topping << " topping. Mmm." << endl;
+        size_t pos = m_enqueuePos.load(memory_order_relaxed);
+        for (;;) {
+            Cell& cell = m_cells[pos & m_mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.value = forward<U>(value);
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = m_enqueuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+    bool tryPop(T& value)
+    {
+        return tryPopBatch(&value, 1) == 1;
+    }
+    // Claims up to maxCount consecutive ready cells with a single CAS
+    size_t tryPopBatch(T* out, size_t maxCount)
+    {
+        size_t pos = m_dequeuePos.load(memory_order_relaxed);
+        for (;;) {
+            size_t ready = 0;
+            while (ready < maxCount) {
+                const Cell& cell = m_cells[(pos + ready) & m_mask];
+                if (cell.sequence.load(memory_order_acquire) != pos + ready + 1)
+                    break;
+                ready++;
+            }
+            if (ready == 0) {
+                size_t current = m_dequeuePos.load(memory_order_relaxed);
+                if (current == pos)
+                    return 0; // empty
+                pos = current;
+                continue;
+            }
+            if (!m_dequeuePos.compare_exchange_weak(pos, pos + ready, memory_order_relaxed))
+                continue;
+            for (size_t i = 0; i < ready; i++) {
+                Cell& cell = m_cells[(pos + i) & m_mask];
+                out[i] = move(cell.value);
+                cell.sequence.store(pos + i + m_mask + 1, memory_order_release);
+            }
+            return ready;
+        }
     }
 private:
-    string m_dough;
-    string m_sauce;
-    string m_topping;
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
+    unique_ptr<Cell[]> m_cells;
+    size_t m_mask;
+    alignas(64) atomic<size_t> m_enqueuePos{0};
+    alignas(64) atomic<size_t> m_dequeuePos{0};
 };
 
-// "Abstract Builder"
-class PizzaBuilder
+// The mutex + condition variable queue the lock-free one is measured against
+template <typename T>
+class LockingQueue
 {
 public:
-    virtual ~PizzaBuilder() {};
+    explicit LockingQueue(size_t capacity) : m_capacity(capacity) {}
 
-    Pizza* getPizza()
+    template <typename U>
+    bool tryPush(U&& value)
     {
-        return m_pizza.get();
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_items.size() >= m_capacity)
+                return false;
+            m_items.push_back(forward<U>(value));
+        }
+        m_notEmpty.notify_one();
+        return true;
     }
-    void createNewPizzaProduct()
+    // Blocks until at least one item is available or the timeout expires
+    size_t popBatch(T* out, size_t maxCount, chrono::milliseconds timeout)
     {
-        m_pizza = make_unique<Pizza>();
+        unique_lock<mutex> lock(m_mutex);
+        m_notEmpty.wait_for(lock, timeout, [this] { return !m_items.empty(); });
+        size_t count = min(maxCount, m_items.size());
+        for (size_t i = 0; i < count; i++) {
+            out[i] = move(m_items.front());
+            m_items.pop_front();
+        }
+        return count;
     }
-    virtual void buildDough() = 0;
-    virtual void buildSauce() = 0;
-    virtual void buildTopping() = 0;
-protected:
-    unique_ptr<Pizza> m_pizza;
+private:
+    size_t m_capacity;
+    mutex m_mutex;
+    condition_variable m_notEmpty;
+    deque<T> m_items;
 };
 
 //----------------------------------------------------------------
 
-class HawaiianPizzaBuilder : public PizzaBuilder
+/* Assembly line: dough, sauce and topping are separate stations, each on
+ * its own thread with its own clone of the recipe's builder, joined by
+ * bounded MpmcQueues. A station moves pizzas in batches and waits when its
+ * input is empty or its output is full, so many pizzas are in flight at
+ * once. Per-station occupancy (busy time / wall time) and input queue
+ * depth show which station is the bottleneck. */
+class PizzaPipeline
 {
 public:
-    virtual ~HawaiianPizzaBuilder() {};
+    struct StationStats
+    {
+        const char* name;
+        size_t processed = 0;
+        double occupancy = 0;
+        double meanQueueDepth = 0;
+        size_t maxQueueDepth = 0;
+    };
 
-    virtual void buildDough()
+    explicit PizzaPipeline(const PizzaBuilder& recipe, size_t queueCapacity = 1024,
+                           size_t batchSize = 64)
+        : m_recipe(recipe), m_batchSize(max<size_t>(batchSize, 1)),
+          m_toSauce(queueCapacity), m_toTopping(queueCapacity) {}
+
+    vector<PizzaPtr> run(size_t count)
     {
-        m_pizza->setDough("cross");
+        vector<PizzaPtr> finished;
+        finished.reserve(count);
+        for (StationStats& station : m_stats)
+            station = { station.name };
+        auto start = chrono::steady_clock::now();
+
+        thread dough([&] {
+            runStation(m_stats[0], count, nullptr, &m_toSauce, &PizzaBuilder::buildDough, nullptr);
+        });
+        thread sauce([&] {
+            runStation(m_stats[1], count, &m_toSauce, &m_toTopping, &PizzaBuilder::buildSauce, nullptr);
+        });
+        thread topping([&] {
+            runStation(m_stats[2], count, &m_toTopping, nullptr, &PizzaBuilder::buildTopping, &finished);
+        });
+        dough.join();
+        sauce.join();
+        topping.join();
+
+        double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        for (StationStats& station : m_stats)
+            station.occupancy = wall > 0 ? station.occupancy / wall : 0;
+        return finished;
     }
-    virtual void buildSauce()
+    const StationStats* stats() const
     {
-        m_pizza->setSauce("mild");
+        return m_stats;
     }
-    virtual void buildTopping()
+    static constexpr size_t stations = 3;
+private:
+    using Queue = MpmcQueue<PizzaPtr>;
+
+    void runStation(StationStats& stats, size_t count, Queue* in, Queue* out,
+                    void (PizzaBuilder::*step)(), vector<PizzaPtr>* finished)
     {
-        m_pizza->setTopping("ham+pineapple");
+        unique_ptr<PizzaBuilder> builder = m_recipe.clone();
+        vector<PizzaPtr> batch(m_batchSize);
+        double busy = 0;
+        size_t depthSamples = 0, depthTotal = 0;
+        while (stats.processed < count) {
+            size_t size;
+            if (in) {
+                size_t depth = in->sizeApprox();
+                depthTotal += depth;
+                depthSamples++;
+                stats.maxQueueDepth = max(stats.maxQueueDepth, depth);
+                size = in->tryPopBatch(batch.data(), m_batchSize);
+                if (size == 0) {
+                    this_thread::yield();
+                    continue;
+                }
+            } else {
+                size = min(m_batchSize, count - stats.processed);
+            }
+
+            auto begin = chrono::steady_clock::now();
+            for (size_t i = 0; i < size; i++) {
+                if (in)
+                    builder->adoptPizza(move(batch[i]));
+                else
+                    builder->createNewPizzaProduct();
+                (builder.get()->*step)();
+                batch[i] = builder->releasePizza();
+            }
+            busy += chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+            for (size_t i = 0; i < size; i++) {
+                if (finished) {
+                    finished->push_back(move(batch[i]));
+                    continue;
+                }
+                while (!out->tryPush(move(batch[i])))
+                    this_thread::yield(); // next station is behind
+            }
+            stats.processed += size;
+        }
+        stats.occupancy = busy;
+        stats.meanQueueDepth = depthSamples ? double(depthTotal) / depthSamples : 0;
     }
+
+    const PizzaBuilder& m_recipe;
+    size_t m_batchSize;
+    Queue m_toSauce;
+    Queue m_toTopping;
+    StationStats m_stats[stations] = { { "dough" }, { "sauce" }, { "topping" } };
 };
 
-class SpicyPizzaBuilder : public PizzaBuilder
+// A menu of the two classic recipes plus generated house specials
+vector<RecipeSpec> sampleMenu(size_t houseSpecials)
+{
+    static const char* doughs[] = { "cross", "pan baked", "thin", "sourdough" };
+    static const char* sauces[] = { "mild", "hot", "pesto", "garlic" };
+    static const char* toppings[] = { "ham+pineapple", "pepperoni+salami", "mushroom", "olive+onion" };
+    vector<RecipeSpec> menu = { { "hawaiian", "cross", "mild", "ham+pineapple" },
+                                { "spicy", "pan baked", "hot", "pepperoni+salami" } };
+    for (size_t i = 0; i < houseSpecials; i++)
+        menu.push_back({ "house-" + to_string(i), doughs[i % 4], sauces[(i / 4) % 4],
+                         toppings[(i / 16) % 4] });
+    return menu;
+}
+
+//----------------------------------------------------------------
+
+/* Columnar store for large numbers of finished pizzas: dough ids, sauce
+ * ids and topping sets live in three dense 16-bit columns. A scan answers a
+ * PizzaQuery with a match bitmap (bit i of word i / 64 is set when row i
+ * matches), working 64 rows per bitmap word. Every predicate is
+ * (column & mask) == value: an id test uses the full mask, a topping test
+ * uses the wanted set as both. On x86 the comparisons use AVX2 when the
+ * CPU has it and SSE2 otherwise; other targets use the scalar loop. */
+constexpr IngredientId anyIngredient = 0xFFFF;
+static_assert(anyIngredient >= IngredientTable::capacity, "anyIngredient must never be a real id");
+
+struct PizzaQuery
+{
+    IngredientId dough = anyIngredient;
+    IngredientId sauce = anyIngredient;
+    ToppingSet toppings; // every listed topping must be present
+};
+
+class PizzaCatalog
 {
 public:
-    virtual ~SpicyPizzaBuilder() {};
+    enum class Isa { Scalar, Sse2, Avx2 };
 
-    virtual void buildDough()
+    void append(const Pizza& pizza)
     {
-        m_pizza->setDough("pan baked");
+        m_dough.push_back(pizza.dough());
+        m_sauce.push_back(pizza.sauce());
+        m_toppings.push_back(pizza.toppings().bits());
     }
-    virtual void buildSauce()
+    void append(const Pizza* pizzas, size_t count)
     {
-        m_pizza->setSauce("hot");
+        for (size_t i = 0; i < count; i++)
+            append(pizzas[i]);
     }
-    virtual void buildTopping()
+    size_t size() const
+    {
+        return m_dough.size();
+    }
+    Pizza pizza(size_t row) const
+    {
+        Pizza pizza;
+        pizza.setDough(m_dough[row]);
+        pizza.setSauce(m_sauce[row]);
+        pizza.setToppings(ToppingSet::fromBits(m_toppings[row]));
+        return pizza;
+    }
+    static Isa bestIsa()
     {
-        m_pizza->setTopping("pepperoni+salami");
+#ifdef PIZZA_HAVE_X86_SIMD
+        return __builtin_cpu_supports("avx2") ? Isa::Avx2 : Isa::Sse2;
+#else
+        return Isa::Scalar;
+#endif
     }
+    vector<uint64_t> scan(const PizzaQuery& query, Isa isa = bestIsa()) const
+    {
+        vector<uint64_t> bitmap((size() + 63) / 64, ~uint64_t(0));
+        struct Predicate
+        {
+            const vector<uint16_t>& column;
+            bool active;
+            uint16_t mask;
+            uint16_t value;
+        };
+        const Predicate predicates[] = {
+            { m_dough, query.dough != anyIngredient, 0xFFFF, query.dough },
+            { m_sauce, query.sauce != anyIngredient, 0xFFFF, query.sauce },
+            { m_toppings, !query.toppings.empty(), query.toppings.bits(), query.toppings.bits() } };
+        for (const Predicate& predicate : predicates)
+            if (predicate.active)
+                scanColumn(predicate.column.data(), predicate.mask, predicate.value, bitmap.data(), isa);
+        if (size() % 64)
+            bitmap.back() &= (uint64_t(1) << (size() % 64)) - 1;
+        return bitmap;
+    }
+    static size_t countMatches(const vector<uint64_t>& bitmap)
+    {
+        size_t count = 0;
+        for (uint64_t word : bitmap)
+            count += __builtin_popcountll(word);
+        return count;
+    }
+private:
+    // ANDs the rows where (column & mask) == value into the bitmap
+    void scanColumn(const uint16_t* column, uint16_t mask, uint16_t value, uint64_t* bitmap, Isa isa) const
+    {
+        size_t fullWords = size() / 64;
+        switch (isa) {
+#ifdef PIZZA_HAVE_X86_SIMD
+        case Isa::Avx2:
+            scanAvx2(column, mask, value, bitmap, fullWords);
+            break;
+        case Isa::Sse2:
+            scanSse2(column, mask, value, bitmap, fullWords);
+            break;
+#endif
+        default:
+            scanScalar(column, mask, value, bitmap, 0, fullWords);
+            break;
+        }
+        scanScalar(column, mask, value, bitmap, fullWords, (size() + 63) / 64);
+    }
+    void scanScalar(const uint16_t* column, uint16_t mask, uint16_t value, uint64_t* bitmap,
+                    size_t firstWord, size_t lastWord) const
+    {
+        for (size_t word = firstWord; word < lastWord; word++) {
+            uint64_t matches = 0;
+            size_t rows = min<size_t>(64, size() - word * 64);
+            for (size_t bit = 0; bit < rows; bit++)
+                matches |= uint64_t((column[word * 64 + bit] & mask) == value) << bit;
+            bitmap[word] &= matches;
+        }
+    }
+#ifdef PIZZA_HAVE_X86_SIMD
+    __attribute__((target("avx2")))
+    static void scanAvx2(const uint16_t* column, uint16_t mask, uint16_t value, uint64_t* bitmap,
+                         size_t words)
+    {
+        const __m256i masks = _mm256_set1_epi16(static_cast<short>(mask));
+        const __m256i needle = _mm256_set1_epi16(static_cast<short>(value));
+        for (size_t word = 0; word < words; word++) {
+            const __m256i* rows = reinterpret_cast<const __m256i*>(column + word * 64);
+            uint64_t matches = 0;
+            for (int half = 0; half < 2; half++) {
+                __m256i a = _mm256_and_si256(_mm256_loadu_si256(rows + 2 * half), masks);
+                __m256i b = _mm256_and_si256(_mm256_loadu_si256(rows + 2 * half + 1), masks);
+                a = _mm256_cmpeq_epi16(a, needle);
+                b = _mm256_cmpeq_epi16(b, needle);
+                // Narrow 16-bit lanes to bytes; packs interleaves 128-bit lanes, permute restores order
+                __m256i bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+                matches |= uint64_t(uint32_t(_mm256_movemask_epi8(bytes))) << (32 * half);
+            }
+            bitmap[word] &= matches;
+        }
+    }
+    static void scanSse2(const uint16_t* column, uint16_t mask, uint16_t value, uint64_t* bitmap,
+                         size_t words)
+    {
+        const __m128i masks = _mm_set1_epi16(static_cast<short>(mask));
+        const __m128i needle = _mm_set1_epi16(static_cast<short>(value));
+        for (size_t word = 0; word < words; word++) {
+            const __m128i* rows = reinterpret_cast<const __m128i*>(column + word * 64);
+            uint64_t matches = 0;
+            for (int quarter = 0; quarter < 4; quarter++) {
+                __m128i a = _mm_and_si128(_mm_loadu_si128(rows + 2 * quarter), masks);
+                __m128i b = _mm_and_si128(_mm_loadu_si128(rows + 2 * quarter + 1), masks);
+                a = _mm_cmpeq_epi16(a, needle);
+                b = _mm_cmpeq_epi16(b, needle);
+                matches |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_packs_epi16(a, b)))) << (16 * quarter);
+            }
+            bitmap[word] &= matches;
+        }
+    }
+#endif
+
+    vector<IngredientId> m_dough;
+    vector<IngredientId> m_sauce;
+    vector<uint16_t> m_toppings; // ToppingSet bits
 };
 
 //----------------------------------------------------------------
 
-class Cook
+/* Compressed bitmap in the style of Roaring: row numbers are split by
+ * their high 16 bits into containers, and each container stores its low
+ * 16 bits either as a sorted array (up to 4096 values) or as a 65536-bit
+ * bitmap. Sparse and dense sets both stay small, and AND / OR / AND-NOT
+ * work container by container. */
+class RoaringBitmap
 {
 public:
-    void openPizza()
+    void add(uint32_t value)
     {
-        m_pizzaBuilder->getPizza()->open();
+        uint16_t key = value >> 16, low = value & 0xFFFF;
+        auto it = lower_bound(m_containers.begin(), m_containers.end(), key,
+                              [](const Container& c, uint16_t k) { return c.key < k; });
+        if (it == m_containers.end() || it->key != key)
+            it = m_containers.insert(it, Container{ key });
+        it->add(low);
     }
-    void makePizza(PizzaBuilder* pb)
+    bool contains(uint32_t value) const
     {
-        m_pizzaBuilder = pb;
-        m_pizzaBuilder->createNewPizzaProduct();
-        m_pizzaBuilder->buildDough();
-        m_pizzaBuilder->buildSauce();
-        m_pizzaBuilder->buildTopping();
+        const Container* container = find(value >> 16);
+        return container && container->contains(value & 0xFFFF);
+    }
+    size_t cardinality() const
+    {
+        size_t total = 0;
+        for (const Container& container : m_containers)
+            total += container.cardinality;
+        return total;
+    }
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        for (const Container& container : m_containers)
+            container.forEach([&](uint16_t low) { f(uint32_t(container.key) << 16 | low); });
+    }
+    // All values in [0, count)
+    static RoaringBitmap range(uint32_t count)
+    {
+        RoaringBitmap result;
+        for (uint32_t start = 0; start < count; start += 65536) {
+            Container container{ static_cast<uint16_t>(start >> 16) };
+            uint32_t size = min<uint32_t>(65536, count - start);
+            container.bits.assign(1024, 0);
+            for (uint32_t word = 0; word < size / 64; word++)
+                container.bits[word] = ~uint64_t(0);
+            if (size % 64)
+                container.bits[size / 64] = (uint64_t(1) << (size % 64)) - 1;
+            container.cardinality = size;
+            container.normalize();
+            result.m_containers.push_back(move(container));
+        }
+        return result;
+    }
+    friend RoaringBitmap operator&(const RoaringBitmap& a, const RoaringBitmap& b)
+    {
+        return combine(a, b, And);
+    }
+    friend RoaringBitmap operator|(const RoaringBitmap& a, const RoaringBitmap& b)
+    {
+        return combine(a, b, Or);
+    }
+    friend RoaringBitmap operator-(const RoaringBitmap& a, const RoaringBitmap& b)
+    {
+        return combine(a, b, AndNot);
     }
 private:
-    PizzaBuilder* m_pizzaBuilder;
+    static constexpr size_t arrayLimit = 4096;
+    enum Op { And, Or, AndNot };
+
+    struct Container
+    {
+        explicit Container(uint16_t key) : key(key) {}
+
+        uint16_t key;
+        vector<uint16_t> array; // sorted values while the container is sparse
+        vector<uint64_t> bits;  // 1024 words once it is dense
+        size_t cardinality = 0;
+
+        bool isBitmap() const
+        {
+            return !bits.empty();
+        }
+        bool contains(uint16_t low) const
+        {
+            if (isBitmap())
+                return bits[low / 64] >> (low % 64) & 1;
+            return binary_search(array.begin(), array.end(), low);
+        }
+        void add(uint16_t low)
+        {
+            if (isBitmap()) {
+                uint64_t& word = bits[low / 64];
+                cardinality += !(word >> (low % 64) & 1);
+                word |= uint64_t(1) << (low % 64);
+                return;
+            }
+            // Rows usually arrive in increasing order, so appending is the common case
+            if (array.empty() || array.back() < low) {
+                array.push_back(low);
+            } else {
+                auto it = lower_bound(array.begin(), array.end(), low);
+                if (*it == low)
+                    return;
+                array.insert(it, low);
+            }
+            cardinality++;
+            if (cardinality > arrayLimit)
+                toBitmap();
+        }
+        template <typename F>
+        void forEach(F&& f) const
+        {
+            if (!isBitmap()) {
+                for (uint16_t low : array)
+                    f(low);
+                return;
+            }
+            for (size_t word = 0; word < bits.size(); word++)
+                for (uint64_t w = bits[word]; w; w &= w - 1)
+                    f(static_cast<uint16_t>(word * 64 + __builtin_ctzll(w)));
+        }
+        void toBitmap()
+        {
+            bits.assign(1024, 0);
+            for (uint16_t low : array)
+                bits[low / 64] |= uint64_t(1) << (low % 64);
+            array.clear();
+            array.shrink_to_fit();
+        }
+        // Recounts a bitmap container and turns it back into an array if it became sparse
+        void normalize()
+        {
+            if (!isBitmap())
+                return;
+            cardinality = 0;
+            for (uint64_t word : bits)
+                cardinality += __builtin_popcountll(word);
+            if (cardinality > arrayLimit)
+                return;
+            array.clear();
+            forEach([&](uint16_t low) { array.push_back(low); });
+            bits.clear();
+            bits.shrink_to_fit();
+        }
+    };
+
+    const Container* find(uint16_t key) const
+    {
+        auto it = lower_bound(m_containers.begin(), m_containers.end(), key,
+                              [](const Container& c, uint16_t k) { return c.key < k; });
+        return it != m_containers.end() && it->key == key ? &*it : nullptr;
+    }
+    static Container combine(const Container& a, const Container& b, Op op)
+    {
+        Container result{ a.key };
+        if (!a.isBitmap() && !b.isBitmap()) {
+            auto out = back_inserter(result.array);
+            if (op == And)
+                set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+            else if (op == Or)
+                set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+            else
+                set_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+            result.cardinality = result.array.size();
+            if (result.cardinality > arrayLimit)
+                result.toBitmap();
+            return result;
+        }
+        if (!a.isBitmap() && op != Or) {
+            // A sparse left side only needs membership tests against the right
+            for (uint16_t low : a.array)
+                if (b.contains(low) == (op == And))
+                    result.array.push_back(low);
+            result.cardinality = result.array.size();
+            return result;
+        }
+        Container left = a, right = b;
+        if (!left.isBitmap())
+            left.toBitmap();
+        if (!right.isBitmap())
+            right.toBitmap();
+        result.bits.resize(1024);
+        for (size_t word = 0; word < 1024; word++) {
+            uint64_t x = left.bits[word], y = right.bits[word];
+            result.bits[word] = op == And ? x & y : op == Or ? x | y : x & ~y;
+        }
+        result.normalize();
+        return result;
+    }
+    static RoaringBitmap combine(const RoaringBitmap& a, const RoaringBitmap& b, Op op)
+    {
+        RoaringBitmap result;
+        size_t i = 0, j = 0;
+        while (i < a.m_containers.size() || j < b.m_containers.size()) {
+            bool hasA = i < a.m_containers.size(), hasB = j < b.m_containers.size();
+            if (hasA && (!hasB || a.m_containers[i].key < b.m_containers[j].key)) {
+                if (op != And)
+                    result.m_containers.push_back(a.m_containers[i]);
+                i++;
+            } else if (hasB && (!hasA || b.m_containers[j].key < a.m_containers[i].key)) {
+                if (op == Or)
+                    result.m_containers.push_back(b.m_containers[j]);
+                j++;
+            } else {
+                Container merged = combine(a.m_containers[i++], b.m_containers[j++], op);
+                if (merged.cardinality > 0)
+                    result.m_containers.push_back(move(merged));
+            }
+        }
+        return result;
+    }
+
+    vector<Container> m_containers; // sorted by key
+};
+
+/* Stored pizzas plus one RoaringBitmap of row numbers per dough, sauce and
+ * topping. append() updates the bitmaps as each pizza arrives, and
+ * queries are built from the bitmaps with &, | and - (NOT x is
+ * all() - x). */
+class PizzaIndex
+{
+public:
+    uint32_t append(const Pizza& pizza)
+    {
+        uint32_t row = static_cast<uint32_t>(m_pizzas.size());
+        m_pizzas.push_back(pizza);
+        m_dough[pizza.dough()].add(row);
+        m_sauce[pizza.sauce()].add(row);
+        uint16_t toppings = pizza.toppings().bits();
+        for (unsigned bit = 0; bit < ToppingTable::capacity; bit++)
+            if (toppings >> bit & 1)
+                m_topping[bit].add(row);
+        return row;
+    }
+    size_t size() const
+    {
+        return m_pizzas.size();
+    }
+    const Pizza& pizza(uint32_t row) const
+    {
+        return m_pizzas[row];
+    }
+    const RoaringBitmap& withDough(IngredientId dough) const
+    {
+        return lookup(m_dough, dough);
+    }
+    const RoaringBitmap& withSauce(IngredientId sauce) const
+    {
+        return lookup(m_sauce, sauce);
+    }
+    const RoaringBitmap& withTopping(Topping topping) const
+    {
+        return m_topping[static_cast<size_t>(topping)];
+    }
+    RoaringBitmap all() const
+    {
+        return RoaringBitmap::range(static_cast<uint32_t>(m_pizzas.size()));
+    }
+private:
+    using Postings = unordered_map<IngredientId, RoaringBitmap>;
+
+    static const RoaringBitmap& lookup(const Postings& postings, IngredientId id)
+    {
+        static const RoaringBitmap none;
+        auto it = postings.find(id);
+        return it != postings.end() ? it->second : none;
+    }
+
+    vector<Pizza> m_pizzas;
+    Postings m_dough;
+    Postings m_sauce;
+    RoaringBitmap m_topping[ToppingTable::capacity];
+};
+
+//----------------------------------------------------------------
+
+/* Flyweight store: structurally identical pizzas are hash-consed into one
+ * shared, immutable instance. Holders keep a 4-byte PizzaHandle, so two
+ * pizzas are equal exactly when their handles are. Each instance is
+ * reference counted: intern() and retain() add a reference, release()
+ * drops one, and the slot is recycled when the count reaches zero. Not
+ * thread-safe. */
+struct PizzaHandle
+{
+    uint32_t id;
+
+    friend bool operator==(PizzaHandle a, PizzaHandle b)
+    {
+        return a.id == b.id;
+    }
+    friend bool operator!=(PizzaHandle a, PizzaHandle b)
+    {
+        return a.id != b.id;
+    }
+};
+
+class PizzaFlyweights
+{
+public:
+    PizzaHandle intern(const Pizza& pizza)
+    {
+        auto it = m_ids.find(pizza);
+        if (it != m_ids.end()) {
+            m_slots[it->second].refs++;
+            return { it->second };
+        }
+        uint32_t id;
+        if (m_free.empty()) {
+            id = static_cast<uint32_t>(m_slots.size());
+            m_slots.push_back({ pizza, 1 });
+        } else {
+            id = m_free.back();
+            m_free.pop_back();
+            m_slots[id] = { pizza, 1 };
+        }
+        m_ids.emplace(pizza, id);
+        return { id };
+    }
+    void retain(PizzaHandle handle)
+    {
+        m_slots[handle.id].refs++;
+    }
+    void release(PizzaHandle handle)
+    {
+        Slot& slot = m_slots[handle.id];
+        if (--slot.refs > 0)
+            return;
+        m_ids.erase(slot.pizza);
+        m_free.push_back(handle.id);
+    }
+    const Pizza& get(PizzaHandle handle) const
+    {
+        return m_slots[handle.id].pizza;
+    }
+    uint32_t refCount(PizzaHandle handle) const
+    {
+        return m_slots[handle.id].refs;
+    }
+    size_t uniqueCount() const
+    {
+        return m_ids.size();
+    }
+    // Approximate bytes held by the store itself
+    size_t memoryUsage() const
+    {
+        return m_slots.capacity() * sizeof(Slot) + m_free.capacity() * sizeof(uint32_t)
+             + m_ids.bucket_count() * sizeof(void*)
+             + m_ids.size() * (sizeof(pair<const Pizza, uint32_t>) + 2 * sizeof(void*));
+    }
+private:
+    struct Slot
+    {
+        Pizza pizza;
+        uint32_t refs;
+    };
+    struct PizzaHash
+    {
+        size_t operator()(const Pizza& pizza) const
+        {
+            return pizza.hash();
+        }
+    };
+
+    vector<Slot> m_slots;
+    vector<uint32_t> m_free;
+    unordered_map<Pizza, uint32_t, PizzaHash> m_ids;
+};
+
+/* Allocation counters for the benchmarks: every operator new in the
+ * program is routed through here. The counters are per thread, so an
+ * allocation costs two plain increments and threads never share a cache
+ * line over them; measure() reads the ones of the thread running its op. */
+thread_local size_t allocationCount = 0;
+thread_local size_t allocatedBytes = 0;
+
+void* operator new(size_t size)
+{
+    allocationCount++;
+    allocatedBytes += size;
+    if (void* memory = malloc(size ? size : 1))
+        return memory;
+    throw bad_alloc();
+}
+// Kept out of line so the compiler does not pair free() with the new expressions it sees
+__attribute__((noinline)) void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+template <typename F>
+double nsPerOp(size_t ops, F&& f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    auto elapsed = chrono::steady_clock::now() - start;
+    return chrono::duration<double, nano>(elapsed).count() / ops;
+}
+
+/* Runs op(0) .. op(calls - 1), timing them in samples of 64 calls. Each
+ * call produces itemsPerCall pizzas and every figure is per pizza: the
+ * mean, the p50/p99 of the per-sample means (not of single orders), and
+ * the allocations and bytes allocated on the calling thread. */
+struct BenchResult
+{
+    double mean;
+    double p50;
+    double p99;
+    double allocations;
+    double bytes;
 };
 
+template <typename F>
+BenchResult measure(size_t calls, size_t itemsPerCall, F&& op)
+{
+    const size_t sampleSize = 64;
+    vector<double> samples;
+    samples.reserve(calls / sampleSize + 1);
+    size_t allocationsBefore = allocationCount, bytesBefore = allocatedBytes;
+    auto start = chrono::steady_clock::now();
+    for (size_t first = 0; first < calls; first += sampleSize) {
+        size_t last = min(first + sampleSize, calls);
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = first; i < last; i++)
+            op(i);
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+        samples.push_back(ns / ((last - first) * itemsPerCall));
+    }
+    double total = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    double items = double(calls) * itemsPerCall;
+    BenchResult result = { total / items, 0, 0, (allocationCount - allocationsBefore) / items,
+                           (allocatedBytes - bytesBefore) / items };
+    sort(samples.begin(), samples.end());
+    if (!samples.empty()) {
+        result.p50 = samples[samples.size() / 2];
+        result.p99 = samples[samples.size() * 99 / 100];
+    }
+    return result;
+}
+
+void printBench(string_view name, const BenchResult& result)
+{
+    console() << name << ": " << result.mean << " ns/pizza (64-call sample mean p50 " << result.p50
+              << ", p99 " << result.p99 << "), " << result.allocations << " allocs/pizza, "
+              << result.bytes << " bytes/pizza" << '\n';
+}
+
+void runBuilderBenchmarks()
+{
+    const size_t orders = 100000;
+    Cook cook;
+    HawaiianPizzaBuilder hawaiianPizzaBuilder;
+    SpicyPizzaBuilder spicyPizzaBuilder;
+    vector<Pizza> pizzas(orders);
+
+    console() << "sizeof(Pizza): " << sizeof(Pizza) << " bytes" << '\n';
+
+    // The four dispatch strategies, alternating between the two recipes
+    PizzaBuilder* builders[2] = { &hawaiianPizzaBuilder, &spicyPizzaBuilder };
+    printBench("virtual builder       ", measure(orders, 1, [&](size_t i) {
+        cook.makePizza(builders[i & 1]);
+        pizzas[i] = *builders[i & 1]->getPizza();
+    }));
+
+    using AnyStaticPizzaBuilder = variant<StaticHawaiianPizzaBuilder, StaticSpicyPizzaBuilder>;
+    AnyStaticPizzaBuilder variants[2] = { StaticHawaiianPizzaBuilder(), StaticSpicyPizzaBuilder() };
+    printBench("variant builder       ", measure(orders, 1, [&](size_t i) {
+        pizzas[i] = cook.makePizza(variants[i & 1]);
+    }));
+
+    StaticHawaiianPizzaBuilder staticHawaiianPizzaBuilder;
+    StaticSpicyPizzaBuilder staticSpicyPizzaBuilder;
+    printBench("CRTP builder          ", measure(orders, 1, [&](size_t i) {
+        pizzas[i] = (i & 1) ? cook.makePizza(staticSpicyPizzaBuilder)
+                            : cook.makePizza(staticHawaiianPizzaBuilder);
+    }));
+
+    printBench("constexpr menu        ", measure(orders, 1, [&](size_t i) {
+        pizzas[i] = staticMenu[i & 1].pizza;
+    }));
+
+    const size_t batchSize = 64;
+    printBench("batched builder       ", measure(orders / batchSize, batchSize, [&](size_t i) {
+        cook.makePizzas(builders[i & 1], pizzas.data() + i * batchSize, batchSize);
+    }));
+
+    // Allocation strategies for the virtual builder
+    PizzaPrototypeCache prototypes;
+    printBench("prototype cache       ", measure(orders, 1, [&](size_t i) {
+        pizzas[i] = prototypes.makePizza(builders[i & 1]);
+    }));
+
+    PizzaPool pool(1);
+    spicyPizzaBuilder.setPizzaPool(&pool);
+    printBench("pooled product        ", measure(orders, 1, [&](size_t i) {
+        cook.makePizza(&spicyPizzaBuilder);
+        PizzaPtr pizza = spicyPizzaBuilder.releasePizza();
+        pizzas[i] = *pizza;
+        pool.release(move(pizza));
+    }));
+    spicyPizzaBuilder.setPizzaPool(nullptr);
+
+    PizzaBatch batch(orders * sizeof(Pizza) * 2);
+    spicyPizzaBuilder.setMemoryResource(batch.resource());
+    printBench("arena product         ", measure(orders, 1, [&](size_t i) {
+        cook.makePizza(&spicyPizzaBuilder);
+        pizzas[i] = *spicyPizzaBuilder.getPizza();
+    }));
+    spicyPizzaBuilder.setMemoryResource(nullptr);
+    batch.reset();
+
+    printBench("arena batch           ", measure(orders / batchSize, batchSize, [&](size_t) {
+        cook.makePizzas(&spicyPizzaBuilder, batch, batchSize);
+    }));
+    batch.reset();
+
+    // Allergen screening only reads the sauce
+    size_t hotSauces = 0;
+    printBench("eager sauce check     ", measure(orders, 1, [&](size_t i) {
+        cook.makePizza(builders[i & 1]);
+        hotSauces += builders[i & 1]->getPizza()->sauce() == Ingredient::Hot;
+    }));
+    printBench("lazy sauce check      ", measure(orders, 1, [&](size_t i) {
+        hotSauces += cook.makeLazyPizza(builders[i & 1]).sauce() == Ingredient::Hot;
+    }));
+    console().flush();
+
+    const size_t kitchenOrders = 64;
+    for (size_t cooks = 1; cooks <= thread::hardware_concurrency(); cooks *= 2) {
+        Kitchen kitchen(cooks);
+        double kitchenNs = nsPerOp(kitchenOrders * orders, [&] {
+            vector<future<vector<Pizza>>> results;
+            for (size_t i = 0; i < kitchenOrders; i++)
+                results.push_back(kitchen.submit({ &spicyPizzaBuilder, orders }));
+            for (auto& result : results)
+                result.get();
+        });
+        console() << "Kitchen (" << cooks << " cooks)      : " << kitchenNs << " ns/pizza" << '\n';
+        PoolOptions pinned;
+        pinned.pinThreads = true;
+        pinned.arenaBytes = 64 * 1024;
+        Kitchen pinnedKitchen(cooks, 4096, pinned);
+        double pinnedNs = nsPerOp(kitchenOrders * orders, [&] {
+            vector<future<vector<Pizza>>> results;
+            for (size_t i = 0; i < kitchenOrders; i++)
+                results.push_back(pinnedKitchen.submit({ &spicyPizzaBuilder, orders }));
+            for (auto& result : results)
+                result.get();
+        });
+        console() << "  pinned, " << pinnedKitchen.nodes() << " node(s)   : " << pinnedNs << " ns/pizza" << '\n';
+        console().flush();
+    }
+
+    // Front-end threads push single-pizza orders, cooks drain them in batches
+    const size_t producers = 4, consumers = 4, queuedOrders = 1 << 20;
+    auto drainOrders = [&](auto&& tryPush, auto&& popBatch) {
+        atomic<size_t> served{0};
+        vector<thread> threads;
+        for (size_t p = 0; p < producers; p++)
+            threads.emplace_back([&] {
+                for (size_t i = 0; i < queuedOrders / producers; i++)
+                    while (!tryPush(PizzaOrder{ &spicyPizzaBuilder, 1 }))
+                        this_thread::yield(); // backpressure: ring is full
+            });
+        for (size_t c = 0; c < consumers; c++)
+            threads.emplace_back([&] {
+                unique_ptr<PizzaBuilder> builder = spicyPizzaBuilder.clone();
+                Cook cook;
+                PizzaOrder batch[64];
+                while (served < queuedOrders) {
+                    size_t count = popBatch(batch, 64);
+                    for (size_t i = 0; i < count; i++)
+                        cook.makePizza(builder.get());
+                    served += count;
+                }
+            });
+        for (thread& t : threads)
+            t.join();
+    };
+
+    MpmcQueue<PizzaOrder> ring(4096);
+    double lockFree = nsPerOp(queuedOrders, [&] {
+        drainOrders([&](const PizzaOrder& order) { return ring.tryPush(order); },
+                    [&](PizzaOrder* out, size_t max) {
+                        size_t count = ring.tryPopBatch(out, max);
+                        if (count == 0)
+                            this_thread::yield();
+                        return count;
+                    });
+    });
+    LockingQueue<PizzaOrder> locked(4096);
+    double mutexed = nsPerOp(queuedOrders, [&] {
+        drainOrders([&](const PizzaOrder& order) { return locked.tryPush(order); },
+                    [&](PizzaOrder* out, size_t max) {
+                        return locked.popBatch(out, max, chrono::milliseconds(1));
+                    });
+    });
+    console() << "Order queue (lock-free): " << lockFree << " ns/order" << '\n';
+    console() << "Order queue (mutex)    : " << mutexed << " ns/order" << '\n';
+    console().flush();
+
+    const char* menuPath = "pizza_menu.bench";
+    vector<RecipeSpec> bigMenu = sampleMenu(100000);
+    if (writeMenuFile(menuPath, bigMenu)) {
+        MenuFile menu;
+        double openUs = nsPerOp(1, [&] { menu.open(menuPath); }) / 1000;
+        size_t found = 0;
+        double lookup = nsPerOp(orders, [&] {
+            for (size_t i = 0; i < orders; i++)
+                found += menu.find(bigMenu[i % bigMenu.size()].name) != nullptr;
+        });
+        console() << "Menu of " << menu.size() << " recipes: open " << openUs << " us, lookup "
+                  << lookup << " ns (" << found << " found)" << '\n';
+        remove(menuPath);
+    }
+
+    const char* ordersPath = "pizza_orders.bench";
+    vector<Pizza> shipment = cook.makePizzas(&spicyPizzaBuilder, 10 * orders);
+    double written = nsPerOp(shipment.size(), [&] {
+        writePizzaFile(ordersPath, shipment.data(), shipment.size());
+    });
+    PizzaFile received;
+    size_t hot = 0;
+    double read = nsPerOp(shipment.size(), [&] {
+        if (!received.open(ordersPath))
+            return;
+        const PizzaRecord* records = received.records();
+        for (size_t i = 0; i < received.size(); i++)
+            hot += records[i].sauce == Ingredient::Hot;
+    });
+    console() << "Pizza file: write " << written << " ns/pizza, mapped read "
+              << read << " ns/pizza (" << hot << " hot)" << '\n';
+    remove(ordersPath);
+
+    // "All pizzas with hot sauce and pan baked dough" over a million-row catalog
+    vector<unique_ptr<PizzaBuilder>> recipes;
+    recipes.push_back(hawaiianPizzaBuilder.clone());
+    recipes.push_back(spicyPizzaBuilder.clone());
+    for (const RecipeSpec& spec : sampleMenu(14)) {
+        IngredientTable& table = IngredientTable::instance();
+        recipes.push_back(make_unique<TablePizzaBuilder>(table.intern(spec.dough), table.intern(spec.sauce),
+                                                         ToppingSet::parse(spec.topping)));
+    }
+    const size_t catalogSize = 1 << 20;
+    vector<Pizza> stored(catalogSize);
+    PizzaCatalog catalog;
+    for (size_t i = 0; i < catalogSize; i++) {
+        PizzaBuilder* recipe = recipes[(i * 2654435761u >> 7) % recipes.size()].get();
+        cook.makePizza(recipe);
+        stored[i] = *recipe->getPizza();
+        catalog.append(stored[i]);
+    }
+    const IngredientTable& names = IngredientTable::instance();
+    size_t byString = 0;
+    double perObject = nsPerOp(catalogSize, [&] {
+        for (const Pizza& pizza : stored)
+            byString += names.name(pizza.sauce()) == "hot" && names.name(pizza.dough()) == "pan baked";
+    });
+    PizzaQuery hotPanBaked;
+    hotPanBaked.dough = Ingredient::PanBaked;
+    hotPanBaked.sauce = Ingredient::Hot;
+    console() << "Catalog scan (strings, per object): " << perObject << " ns/row, "
+              << byString << " matches" << '\n';
+    const pair<const char*, PizzaCatalog::Isa> isas[] = { { "scalar", PizzaCatalog::Isa::Scalar },
+                                                          { "sse2  ", PizzaCatalog::Isa::Sse2 },
+                                                          { "avx2  ", PizzaCatalog::Isa::Avx2 } };
+    for (const auto& [isaName, isa] : isas) {
+        if (isa > PizzaCatalog::bestIsa())
+            continue;
+        size_t matches = 0;
+        double ns = nsPerOp(catalogSize, [&] {
+            matches = PizzaCatalog::countMatches(catalog.scan(hotPanBaked, isa));
+        });
+        console() << "Catalog scan (" << isaName << ", columnar) : " << ns << " ns/row, "
+                  << matches << " matches" << '\n';
+    }
+
+    PizzaQuery withSalami;
+    withSalami.toppings = { Topping::Salami };
+    size_t salami = 0;
+    double toppingScan = nsPerOp(catalogSize, [&] {
+        salami = PizzaCatalog::countMatches(catalog.scan(withSalami));
+    });
+    console() << "Catalog scan (topping set contains salami): " << toppingScan << " ns/row, "
+              << salami << " matches" << '\n';
+
+    PizzaIndex index;
+    double indexed = nsPerOp(catalogSize, [&] {
+        for (const Pizza& pizza : stored)
+            index.append(pizza);
+    });
+    size_t indexMatches = 0, complexMatches = 0;
+    double andQuery = nsPerOp(1, [&] {
+        indexMatches = (index.withSauce(Ingredient::Hot) & index.withDough(Ingredient::PanBaked)).cardinality();
+    });
+    double complexQuery = nsPerOp(1, [&] {
+        RoaringBitmap notMild = index.all() - index.withSauce(Ingredient::Mild);
+        complexMatches = ((index.withDough(Ingredient::Cross) | index.withDough(Ingredient::PanBaked))
+                          & notMild).cardinality();
+    });
+    console() << "Bitmap index: append " << indexed << " ns/pizza, hot AND pan baked "
+              << andQuery / 1000 << " us (" << indexMatches << " matches), (cross OR pan baked) AND NOT mild "
+              << complexQuery / 1000 << " us (" << complexMatches << " matches)" << '\n';
+    console().flush();
+
+    // Copy and build cost of the three product layouts
+    struct StringPizza
+    {
+        string dough;
+        string sauce;
+        string topping;
+    };
+    vector<StringPizza> stringPizzas(orders);
+    vector<InlinePizza> inlinePizzas(orders);
+    printBench("build, std::string    ", measure(orders, 1, [&](size_t i) {
+        stringPizzas[i].dough = "pan baked";
+        stringPizzas[i].sauce = "hot";
+        stringPizzas[i].topping = "pepperoni+salami";
+    }));
+    printBench("build, inline strings ", measure(orders, 1, [&](size_t i) {
+        inlinePizzas[i].setDough("pan baked");
+        inlinePizzas[i].setSauce("hot");
+        inlinePizzas[i].setTopping("pepperoni+salami");
+    }));
+    printBench("build, interned ids   ", measure(orders, 1, [&](size_t i) {
+        pizzas[i] = cook.makePizza(staticSpicyPizzaBuilder);
+    }));
+    vector<StringPizza> stringCopies(orders);
+    vector<InlinePizza> inlineCopies(orders);
+    vector<Pizza> idCopies(orders);
+    printBench("copy, std::string     ", measure(orders, 1, [&](size_t i) {
+        stringCopies[i] = stringPizzas[i];
+    }));
+    printBench("copy, inline strings  ", measure(orders, 1, [&](size_t i) {
+        inlineCopies[i] = inlinePizzas[i];
+    }));
+    printBench("copy, interned ids    ", measure(orders, 1, [&](size_t i) {
+        idCopies[i] = pizzas[i];
+    }));
+    console().flush();
+
+    // Memory held by an order log of the catalog's pizzas in three layouts
+    size_t bytesBefore = allocatedBytes;
+    vector<PizzaPtr> ownedLog;
+    ownedLog.reserve(catalogSize);
+    for (const Pizza& pizza : stored)
+        ownedLog.push_back(PizzaPtr(new Pizza(pizza)));
+    size_t ownedBytes = allocatedBytes - bytesBefore;
+    ownedLog.clear();
+
+    PizzaFlyweights flyweights;
+    vector<PizzaHandle> handleLog;
+    handleLog.reserve(catalogSize);
+    for (const Pizza& pizza : stored)
+        handleLog.push_back(flyweights.intern(pizza));
+    size_t flyweightBytes = handleLog.capacity() * sizeof(PizzaHandle) + flyweights.memoryUsage();
+    console() << "Order log of " << catalogSize << " pizzas: owned PizzaPtr " << ownedBytes / 1024
+              << " KiB (heap requested), by value " << stored.capacity() * sizeof(Pizza) / 1024
+              << " KiB, flyweight handles " << flyweightBytes / 1024 << " KiB ("
+              << flyweights.uniqueCount() << " unique pizzas)" << '\n';
+    console().flush();
+
+    // Steps that take real time (1 ms each, e.g. an oven) on a recipe with independent steps
+    class SlowPizzaBuilder : public TablePizzaBuilder
+    {
+    public:
+        SlowPizzaBuilder() : TablePizzaBuilder(Ingredient::Cross, Ingredient::Mild, { Topping::Olive }) {}
+        virtual void buildDough()
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+            TablePizzaBuilder::buildDough();
+        }
+        virtual void buildSauce()
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+            TablePizzaBuilder::buildSauce();
+        }
+        virtual void buildTopping()
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+            TablePizzaBuilder::buildTopping();
+        }
+        virtual unique_ptr<PizzaBuilder> clone() const
+        {
+            return make_unique<SlowPizzaBuilder>();
+        }
+    };
+    SlowPizzaBuilder slowPizzaBuilder;
+    const size_t slowOrders = 16;
+    double sequentialMs = nsPerOp(slowOrders, [&] {
+        for (size_t i = 0; i < slowOrders; i++)
+            cook.makePizza(&slowPizzaBuilder);
+    }) / 1e6;
+    StepScheduler scheduler(8);
+    double singleMs = nsPerOp(slowOrders, [&] {
+        for (size_t i = 0; i < slowOrders; i++)
+            scheduler.makePizzas(slowPizzaBuilder, 1).get();
+    }) / 1e6;
+    double orderMs = nsPerOp(1, [&] { scheduler.makePizzas(slowPizzaBuilder, slowOrders).get(); }) / 1e6;
+    console() << "Slow recipe: sequential " << sequentialMs << " ms/pizza, step DAG "
+              << singleMs << " ms/pizza, " << slowOrders << " in one order "
+              << orderMs << " ms total" << '\n';
+    console().flush();
+
+    // A burst of single-pizza orders after a quiet spell, without and with a ready stock
+    PrebuildOptions prebuild;
+    prebuild.stock = slowOrders;
+    prebuild.recipes = 1;
+    Kitchen coldKitchen(4), stockedKitchen(4, 4096, PoolOptions(), prebuild);
+    auto burstMs = [&](Kitchen& kitchen) {
+        return nsPerOp(1, [&] {
+            vector<future<vector<Pizza>>> burst;
+            for (size_t i = 0; i < slowOrders; i++)
+                burst.push_back(kitchen.submit({ &slowPizzaBuilder, 1 }));
+            for (auto& order : burst)
+                order.get();
+        }) / 1e6;
+    };
+    stockedKitchen.submit({ &slowPizzaBuilder, 1 }).get();
+    for (int wait = 0; wait < 1000 && stockedKitchen.prebuildStats().stocked < prebuild.stock; wait++)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    double coldMs = burstMs(coldKitchen);
+    double stockedMs = burstMs(stockedKitchen);
+    Kitchen::PrebuildStats stats = stockedKitchen.prebuildStats();
+    console() << "Burst of " << slowOrders << " slow orders: " << coldMs << " ms cold, " << stockedMs
+              << " ms from stock (" << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.prebuilt << " prebuilt, " << stats.wasted << " wasted)" << '\n';
+    console().flush();
+
+    // Front-end threads each wait for one slow order at a time; a longer window coalesces more
+    const size_t frontEnds = 8, ordersPerFrontEnd = 16;
+    for (long window : { 0, 100, 500, 2000 }) {
+        OrderCoalescer coalescer(chrono::microseconds(window), 4);
+        atomic<long> latencyNs{0};
+        vector<thread> threads;
+        for (size_t t = 0; t < frontEnds; t++)
+            threads.emplace_back([&] {
+                for (size_t i = 0; i < ordersPerFrontEnd; i++) {
+                    auto start = chrono::steady_clock::now();
+                    coalescer.submit({ &slowPizzaBuilder, 1 }).get();
+                    latencyNs += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                }
+            });
+        for (thread& frontEnd : threads)
+            frontEnd.join();
+        OrderCoalescer::Stats coalesced = coalescer.stats();
+        console() << "Coalescing window " << window << " us: " << latencyNs / 1e6 / coalesced.orders
+                  << " ms/order, " << coalesced.builds << " builds for " << coalesced.orders << " orders ("
+                  << coalesced.coalesced << " coalesced)" << '\n';
+        console().flush();
+    }
+
+    PizzaPipeline pipeline(spicyPizzaBuilder);
+    double pipelined = nsPerOp(orders, [&] { pipeline.run(orders); });
+    console() << "Pipeline (3 stations) : " << pipelined << " ns/pizza" << '\n';
+    for (size_t i = 0; i < PizzaPipeline::stations; i++) {
+        const PizzaPipeline::StationStats& station = pipeline.stats()[i];
+        console() << "  " << station.name << ": occupancy " << station.occupancy
+                  << ", queue depth mean " << station.meanQueueDepth
+                  << " max " << station.maxQueueDepth << '\n';
+    }
+    console().flush();
+}
+
 //---------------------------BUILDER ENDS -------------------------------------
 
 /*
@@ -168,11 +3820,11 @@ public:
     MyDocument(char *fn): Document(fn){}
     void Open()
     {
-        cout << "   MyDocument: Open()" << endl;
+        console() << "   MyDocument: Open()" << '\n';
     }
     void Close()
     {
-        cout << "   MyDocument: Close()" << endl;
+        console() << "   MyDocument: Close()" << '\n';
     }
 };
 
@@ -182,12 +3834,12 @@ class Application
 public:
     Application(): _index(0)
     {
-        cout << "Application: ctor" << endl;
+        console() << "Application: ctor" << '\n';
     }
     /* The client will call this "entry point" of the framework */
     void NewDocument(char *name)
     {
-        cout << "Application: NewDocument()" << endl;
+        console() << "Application: NewDocument()" << '\n';
         /* Framework calls the "hole" reserved for client customization */
         _docs[_index] = CreateDocument(name);
         _docs[_index++]->Open();
@@ -204,9 +3856,9 @@ private:
 
 void Application::ReportDocs()
 {
-    cout << "Application: ReportDocs()" << endl;
+    console() << "Application: ReportDocs()" << '\n';
     for (int i = 0; i < _index; i++)
-        cout << "   " << _docs[i]->GetName() << endl;
+        console() << "   " << _docs[i]->GetName() << '\n';
 }
 
 /* Customization of framework defined by client */
@@ -215,12 +3867,12 @@ class MyApplication: public Application
 public:
     MyApplication()
     {
-        cout << "MyApplication: ctor" << endl;
+        console() << "MyApplication: ctor" << '\n';
     }
     /* Client defines Framework's "hole" */
     Document *CreateDocument(char *fn)
     {
-        cout << "   MyApplication: CreateDocument()" << endl;
+        console() << "   MyApplication: CreateDocument()" << '\n';
         return new MyDocument(fn);
     }
 };
@@ -263,25 +3915,25 @@ int Shape::total_ = 0;
 class Circle : public Shape {
 public:
     void draw() {
-        cout << "circle " << id_ << ": draw" << endl;
+        console() << "circle " << id_ << ": draw" << '\n';
     }
 };
 class Square : public Shape {
 public:
     void draw() {
-        cout << "square " << id_ << ": draw" << endl;
+        console() << "square " << id_ << ": draw" << '\n';
     }
 };
 class Ellipse : public Shape {
 public:
     void draw() {
-        cout << "ellipse " << id_ << ": draw" << endl;
+        console() << "ellipse " << id_ << ": draw" << '\n';
     }
 };
 class Rectangle : public Shape {
 public:
     void draw() {
-        cout << "rectangle " << id_ << ": draw" << endl;
+        console() << "rectangle " << id_ << ": draw" << '\n';
     }
 };
 
@@ -325,10 +3977,18 @@ public:
 •	As Abstract Factory is at a higher level in abstraction, it often uses Factory Method to create the products in factories.
 
  */
-int main()
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && string(argv[1]) == "bench") {
+        runBuilderBenchmarks();
+#ifdef PIZZA_PROFILE
+        StepProfiler::dump();
+#endif
+        return 0;
+    }
+
     //Builder starts-------------
-    cout<<"\n----------------BUILDER ---------------------------"<<endl;
+    console() << "\n----------------BUILDER ---------------------------" << '\n';
     Cook cook;
     HawaiianPizzaBuilder hawaiianPizzaBuilder;
     SpicyPizzaBuilder    spicyPizzaBuilder;
@@ -338,20 +3998,181 @@ int main()
 
     cook.makePizza(&spicyPizzaBuilder);
     cook.openPizza();
+
+    StaticSpicyPizzaBuilder staticSpicyPizzaBuilder;
+    cook.makePizza(staticSpicyPizzaBuilder).open();
+
+    if (!isReadOnlyMapping(&staticMenu)) {
+        console() << "Constexpr menu is not in read-only memory" << '\n';
+        console().flush();
+        return 1;
+    }
+    console() << "Constexpr menu of " << staticMenu.size() << " recipes, in read-only memory: ";
+    findStaticRecipe("hawaiian")->pizza.open();
+
+    vector<Pizza> order = cook.makePizzas(&hawaiianPizzaBuilder, 3);
+    for (const Pizza& pizza : order)
+        pizza.open();
+
+    PizzaBatch batch;
+    cook.makePizzas(&spicyPizzaBuilder, batch, 2);
+    for (const Pizza& pizza : batch.pizzas())
+        pizza.open();
+    batch.reset();
+
+    PizzaPool pool;
+    hawaiianPizzaBuilder.setPizzaPool(&pool);
+    cook.makePizza(&hawaiianPizzaBuilder);
+    PizzaPtr takeaway = hawaiianPizzaBuilder.releasePizza();
+    cook.makePizza(&hawaiianPizzaBuilder); // does not touch the takeaway
+    takeaway->open();
+    pool.release(move(takeaway));
+    hawaiianPizzaBuilder.setPizzaPool(nullptr);
+
+    PizzaPipeline pipeline(spicyPizzaBuilder, 16, 4);
+    vector<PizzaPtr> assembled = pipeline.run(2);
+    for (const PizzaPtr& pizza : assembled)
+        pizza->open();
+
+    const char* menuPath = "pizza_menu.bin";
+    MenuFile menu;
+    if (writeMenuFile(menuPath, sampleMenu(1000)) && menu.open(menuPath)) {
+        unique_ptr<PizzaBuilder> special = menu.makeBuilder("house-42");
+        cook.makePizza(special.get());
+        cook.openPizza();
+        console() << "Menu has " << menu.size() << " recipes" << '\n';
+    }
+    remove(menuPath);
+
+    const char* ordersPath = "pizza_orders.bin";
+    PizzaFile shipped;
+    if (writePizzaFile(ordersPath, order.data(), order.size()) && shipped.open(ordersPath)) {
+        console() << "Shipped " << shipped.size() << " pizzas, first one: ";
+        shipped.pizza(0).open();
+    }
+    remove(ordersPath);
+
+    PizzaCatalog catalog;
+    catalog.append(order.data(), order.size());
+    for (const Pizza& pizza : cook.makePizzas(&spicyPizzaBuilder, 2))
+        catalog.append(pizza);
+    PizzaQuery mildSauce;
+    mildSauce.sauce = Ingredient::Mild;
+    console() << "Catalog: " << PizzaCatalog::countMatches(catalog.scan(mildSauce)) << " of "
+              << catalog.size() << " pizzas have mild sauce" << '\n';
+
+    PizzaIndex index;
+    for (PizzaBuilder* pb : { (PizzaBuilder*)&hawaiianPizzaBuilder, (PizzaBuilder*)&spicyPizzaBuilder,
+                              (PizzaBuilder*)&spicyPizzaBuilder }) {
+        cook.makePizza(pb);
+        index.append(*pb->getPizza());
+    }
+    RoaringBitmap notHot = index.all() - index.withSauce(Ingredient::Hot);
+    console() << "Index: " << notHot.cardinality() << " of " << index.size()
+              << " pizzas are not hot, " << index.withTopping(Topping::Salami).cardinality()
+              << " have salami" << '\n';
+
+    if (optional<InlinePizza> boxed = InlinePizza::from(order[0])) {
+        console() << "Inline copy (" << sizeof(*boxed) << " bytes): ";
+        boxed->open();
+    }
+
+    PizzaFlyweights flyweights;
+    PizzaHandle first = flyweights.intern(order[0]);
+    PizzaHandle second = flyweights.intern(order[1]);
+    console() << "Flyweights: identical orders share one pizza: " << (first == second ? "yes" : "no")
+              << ", references " << flyweights.refCount(first) << '\n';
+    flyweights.release(second);
+    flyweights.release(first);
+
+    LazyPizza lazy = cook.makeLazyPizza(&spicyPizzaBuilder);
+    if (lazy.sauce() == Ingredient::Hot)
+        console() << "Allergen check: hot sauce, topping not built yet" << '\n';
+    lazy.open();
+
+    PizzaPrototypeCache prototypes;
+    for (int i = 0; i < 3; i++)
+        prototypes.makePizza(&spicyPizzaBuilder);
+    prototypes.makePizza(&hawaiianPizzaBuilder).open();
+    console() << "Prototype cache: " << prototypes.hits() << " hits, "
+              << prototypes.misses() << " misses" << '\n';
+
+    StepScheduler scheduler(2);
+    vector<Pizza> scheduled = scheduler.makePizzas(spicyPizzaBuilder, 3).get();
+    console() << "Step scheduler on " << scheduler.threads() << " threads: ";
+    scheduled.back().open();
+    // However the steps interleave, every product must come back fully built:
+    // the spicy steps form a chain, the table ones all run concurrently
+    TablePizzaBuilder tablePizzaBuilder(Ingredient::Cross, Ingredient::Hot, { Topping::Olive, Topping::Onion });
+    size_t incomplete = 0;
+    for (PizzaBuilder* recipe : { static_cast<PizzaBuilder*>(&spicyPizzaBuilder),
+                                  static_cast<PizzaBuilder*>(&tablePizzaBuilder) }) {
+        cook.makePizza(recipe);
+        const Pizza reference = *recipe->getPizza();
+        for (int order = 0; order < 2000; order++)
+            for (const Pizza& pizza : scheduler.makePizzas(*recipe, 4).get())
+                incomplete += !(pizza == reference);
+    }
+    if (incomplete > 0) {
+        console() << "Step scheduler returned " << incomplete << " incomplete pizzas" << '\n';
+        console().flush();
+        return 1;
+    }
+
+    CpuTopology topology = CpuTopology::detect();
+    console() << "CPU topology: " << topology.nodes.size() << " NUMA node(s), "
+              << topology.cpuCount() << " usable CPUs" << '\n';
+    PoolOptions pinned;
+    pinned.pinThreads = true;
+    pinned.arenaBytes = 4096;
+    Kitchen pinnedKitchen(2, 4096, pinned);
+    console() << "Pinned kitchen delivered " << pinnedKitchen.submit({ &spicyPizzaBuilder, 100 }).get().size()
+              << " pizzas" << '\n';
+
+    PrebuildOptions prebuild;
+    prebuild.stock = 8;
+    Kitchen stockedKitchen(2, 4096, PoolOptions(), prebuild);
+    stockedKitchen.submit({ &hawaiianPizzaBuilder, 8 }).get();
+    for (int wait = 0; wait < 1000 && stockedKitchen.prebuildStats().stocked < prebuild.stock; wait++)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    stockedKitchen.submit({ &hawaiianPizzaBuilder, 10 }).get();
+    Kitchen::PrebuildStats stock = stockedKitchen.prebuildStats();
+    console() << "Prebuilding kitchen served " << stock.hits << " pizzas from stock and built "
+              << stock.misses << '\n';
+
+    {
+        OrderCoalescer coalescer(chrono::milliseconds(20), 2);
+        vector<future<vector<Pizza>>> orders;
+        for (size_t quantity = 1; quantity <= 3; quantity++)
+            orders.push_back(coalescer.submit({ &spicyPizzaBuilder, quantity }));
+        size_t delivered = 0;
+        for (auto& order : orders)
+            delivered += order.get().size();
+        OrderCoalescer::Stats coalesced = coalescer.stats();
+        console() << "Coalescer: " << coalesced.orders << " orders, " << delivered << " pizzas, "
+                  << coalesced.builds << " build" << '\n';
+    }
+
+    Kitchen kitchen(2);
+    future<vector<Pizza>> delivery = kitchen.submit({ &hawaiianPizzaBuilder, 10000 });
+    console() << "Kitchen with " << kitchen.cooks() << " cooks delivered "
+              << delivery.get().size() << " pizzas" << '\n';
+    console().flush();
     //Builder ends-----------
 
     // Factory Method
-    cout<<"\n----------------FACTORY METHOD ---------------------------"<<endl;
+    console() << "\n----------------FACTORY METHOD ---------------------------" << '\n';
     MyApplication myApp;
 
     myApp.NewDocument("foo");
     myApp.NewDocument("bar");
     myApp.ReportDocs();
+    console().flush();
     // Factory method ends
 
     // Abstract factory
 
-    cout<<"\n----------------ABSTRACT FACTORY ---------------------------"<<endl;
+    console() << "\n----------------ABSTRACT FACTORY ---------------------------" << '\n';
 
     Factory* factory = new SimpleShapeFactory;
     //Factory* factory = new RobustShapeFactory;
@@ -365,6 +4186,7 @@ int main()
         shapes[i]->draw();
     }
 
+    console().flush();
     // Abstract factory ends
 
     return 0;